@@ -0,0 +1,13 @@
+#pragma once
+// Channel table: one entry per CG-3000 driven by this board, in channel
+// order. Channel 1 keeps the plain MQTT topics and HTTP routes, channel n
+// uses cg3000/<deviceId>/ch<n>/... and /ch<n>/power, /ch<n>/reset.
+#include "channel.h"
+
+constexpr ChannelPins CHANNELS[] = {
+    {34, 16, 17}, // ESP32 Relay X2: tuning input, reset relay, power relay
+    // {35, 18, 19}, // a second tuner on a board with more relays
+};
+
+constexpr uint8_t CHANNEL_COUNT = sizeof(CHANNELS) / sizeof(CHANNELS[0]);
+static_assert(CHANNEL_COUNT <= MAX_CHANNELS, "raise CG3000_MAX_CHANNELS for a larger channel table");
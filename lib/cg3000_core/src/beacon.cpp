@@ -0,0 +1,104 @@
+#include "beacon.h"
+
+#include <string.h>
+
+#include "timefmt.h"
+
+static const uint8_t BEACON_MAGIC[4] = {'C', 'G', '3', 'B'};
+static const uint8_t QUERY_MAGIC[4] = {'C', 'G', '3', 'Q'};
+
+static void putU32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t getU32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void beaconFromStatus(Beacon &b, const StatusSnapshot &st)
+{
+  b.flags = (st.mqttConnected ? BEACON_MQTT : 0) | (st.timeValid ? BEACON_TIME_VALID : 0);
+  b.channels = st.channels < BEACON_MAX_CHANNELS ? st.channels : BEACON_MAX_CHANNELS;
+  b.power = 0;
+  b.tuning = 0;
+  for (uint8_t ch = 0; ch < b.channels; ++ch)
+  {
+    b.power |= (st.power[ch] ? 1 : 0) << ch;
+    b.tuning |= (st.tuning[ch] ? 1 : 0) << ch;
+    b.lastReset[ch] = st.lastReset[ch] >= TIME_VALID_AFTER ? (uint32_t)st.lastReset[ch] : 0;
+  }
+  b.uptimeSec = st.uptimeSec;
+}
+
+bool beaconChanged(const Beacon &a, const Beacon &b)
+{
+  if ((a.flags & ~BEACON_REPLY) != (b.flags & ~BEACON_REPLY) || a.channels != b.channels || a.power != b.power ||
+      a.tuning != b.tuning)
+    return true;
+  return memcmp(a.lastReset, b.lastReset, a.channels * sizeof(a.lastReset[0])) != 0;
+}
+
+size_t beaconEncode(const Beacon &b, uint8_t *buf, size_t len)
+{
+  size_t idLen = strnlen(b.id, BEACON_ID_MAX);
+  size_t n = BEACON_HEADER_SIZE + 4 * b.channels + idLen;
+  if (b.channels > BEACON_MAX_CHANNELS || n > len)
+    return 0;
+  memcpy(buf, BEACON_MAGIC, 4);
+  buf[4] = BEACON_VERSION;
+  buf[5] = b.flags;
+  buf[6] = b.channels;
+  buf[7] = b.power;
+  buf[8] = b.tuning;
+  buf[9] = (uint8_t)idLen;
+  putU32(buf + 10, b.seq);
+  putU32(buf + 14, b.uptimeSec);
+  memcpy(buf + 18, b.firmware, BEACON_FIRMWARE_SIZE);
+  uint8_t *p = buf + BEACON_HEADER_SIZE;
+  for (uint8_t ch = 0; ch < b.channels; ++ch, p += 4)
+    putU32(p, b.lastReset[ch]);
+  memcpy(p, b.id, idLen);
+  return n;
+}
+
+size_t beaconQueryEncode(uint8_t *buf, size_t len)
+{
+  if (len < BEACON_QUERY_SIZE)
+    return 0;
+  memcpy(buf, QUERY_MAGIC, 4);
+  buf[4] = BEACON_VERSION;
+  return BEACON_QUERY_SIZE;
+}
+
+bool beaconDecode(const uint8_t *buf, size_t len, Beacon &b)
+{
+  if (len < BEACON_HEADER_SIZE || memcmp(buf, BEACON_MAGIC, 4) != 0 || buf[4] != BEACON_VERSION)
+    return false;
+  b.flags = buf[5];
+  b.channels = buf[6];
+  b.power = buf[7];
+  b.tuning = buf[8];
+  uint8_t idLen = buf[9];
+  if (b.channels > BEACON_MAX_CHANNELS || idLen > BEACON_ID_MAX ||
+      len < BEACON_HEADER_SIZE + 4 * b.channels + idLen)
+    return false;
+  b.seq = getU32(buf + 10);
+  b.uptimeSec = getU32(buf + 14);
+  memcpy(b.firmware, buf + 18, BEACON_FIRMWARE_SIZE);
+  const uint8_t *p = buf + BEACON_HEADER_SIZE;
+  for (uint8_t ch = 0; ch < b.channels; ++ch, p += 4)
+    b.lastReset[ch] = getU32(p);
+  memcpy(b.id, p, idLen);
+  b.id[idLen] = '\0';
+  return true;
+}
+
+bool beaconIsQuery(const uint8_t *buf, size_t len)
+{
+  return len >= BEACON_QUERY_SIZE && memcmp(buf, QUERY_MAGIC, 4) == 0 && buf[4] == BEACON_VERSION;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "status.h"
+
+// Status beacon: one small UDP datagram with the state a fleet dashboard
+// needs, sent to a multicast group on every change and as a heartbeat. A
+// collector can also send a query (to the group or one device) and every
+// device answers it with a beacon to the sender.
+//
+// Wire format, integers little-endian:
+//   0  "CG3B"        magic
+//   4  u8 version    BEACON_VERSION
+//   5  u8 flags      BEACON_MQTT | BEACON_TIME_VALID | BEACON_REPLY
+//   6  u8 channels
+//   7  u8 power      bit n = power relay of channel n
+//   8  u8 tuning     bit n = channel n is tuning
+//   9  u8 idLen
+//  10  u32 seq       per device, counts every beacon sent
+//  14  u32 uptime    seconds
+//  18  u8[8]         firmware hash (start of the image's SHA-256)
+//  26  u32 lastReset[channels] epoch, 0 = none
+//  ..  char id[idLen] device id, not terminated
+// A query is "CG3Q" followed by u8 version.
+const uint8_t BEACON_VERSION = 1;
+const uint8_t BEACON_MAX_CHANNELS = 8; // wire limit of the bitmasks
+const size_t BEACON_ID_MAX = 32;
+const size_t BEACON_FIRMWARE_SIZE = 8;
+const size_t BEACON_HEADER_SIZE = 26;
+const size_t BEACON_MAX = BEACON_HEADER_SIZE + 4 * BEACON_MAX_CHANNELS + BEACON_ID_MAX;
+const size_t BEACON_QUERY_SIZE = 5;
+
+enum BeaconFlag : uint8_t
+{
+  BEACON_MQTT = 0x01,       // connected to the broker
+  BEACON_TIME_VALID = 0x02, // NTP time, lastReset epochs are meaningful
+  BEACON_REPLY = 0x04,      // answer to a query, not a change or heartbeat
+};
+
+struct Beacon
+{
+  uint8_t flags;
+  uint8_t channels;
+  uint8_t power;
+  uint8_t tuning;
+  uint32_t seq;
+  uint32_t uptimeSec;
+  uint8_t firmware[BEACON_FIRMWARE_SIZE];
+  uint32_t lastReset[BEACON_MAX_CHANNELS];
+  char id[BEACON_ID_MAX + 1];
+};
+
+// Takes the relay, tuning, time and broker fields; seq, firmware, id and
+// BEACON_REPLY are left to the caller.
+void beaconFromStatus(Beacon &b, const StatusSnapshot &st);
+
+// True if the fields a change beacon is sent for differ (not seq or uptime).
+bool beaconChanged(const Beacon &a, const Beacon &b);
+
+// Both return the datagram length, 0 if it does not fit.
+size_t beaconEncode(const Beacon &b, uint8_t *buf, size_t len);
+size_t beaconQueryEncode(uint8_t *buf, size_t len);
+
+// False on a wrong magic, version or truncated datagram.
+bool beaconDecode(const uint8_t *buf, size_t len, Beacon &b);
+bool beaconIsQuery(const uint8_t *buf, size_t len);
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+
+// One channel per CG-3000 driven by the board. The firmware's channel table
+// (include/channels.h) fixes the number of channels at compile time; per
+// channel state is kept in arrays of MAX_CHANNELS, so status and publish
+// passes are plain loops without allocation.
+#ifndef CG3000_MAX_CHANNELS
+#define CG3000_MAX_CHANNELS 4
+#endif
+
+const uint8_t MAX_CHANNELS = CG3000_MAX_CHANNELS;
+static_assert(MAX_CHANNELS >= 1 && MAX_CHANNELS <= 8, "channel bitmasks are 8 bits wide");
+
+struct ChannelPins
+{
+  uint8_t tuning; // tuning status input (yellow wire), LOW = tuning
+  uint8_t reset;  // reset relay
+  uint8_t power;  // power relay
+};
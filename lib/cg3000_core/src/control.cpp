@@ -0,0 +1,179 @@
+#include "control.h"
+
+#include <string.h>
+
+#include "entities.h"
+
+const char *const COMMAND_NAME[] = {"power_on", "power_off", "power_toggle", "reset",
+                                    "idle_off", "tune_timeout", "no_reset_tuning"};
+static_assert(sizeof(COMMAND_NAME) / sizeof(COMMAND_NAME[0]) == CMD_RULE_NO_RESET_TUNING + 1,
+              "one name per command type");
+
+bool applyPowerCommand(HalGpio &gpio, uint8_t pin, CommandType type)
+{
+  bool current = gpio.read(pin);
+  bool newState = type == CMD_POWER_TOGGLE ? !current : type == CMD_POWER_ON;
+  if (current == newState)
+    return false;
+  gpio.write(pin, newState);
+  return true;
+}
+
+bool payloadIs(const char *payload, size_t len, const char *literal)
+{
+  size_t n = strlen(literal);
+  return len == n && memcmp(payload, literal, n) == 0;
+}
+
+// Returns 0 if the payload is not a plain decimal number.
+uint32_t payloadToUint(const char *payload, size_t len)
+{
+  uint32_t v = 0;
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (payload[i] < '0' || payload[i] > '9' || v > 100000UL)
+      return 0;
+    v = v * 10 + (payload[i] - '0');
+  }
+  return v;
+}
+
+bool powerCommandFromPayload(const char *payload, size_t len, CommandType &type)
+{
+  if (payloadIs(payload, len, "TOGGLE"))
+    type = CMD_POWER_TOGGLE;
+  else if (payloadIs(payload, len, "ON"))
+    type = CMD_POWER_ON;
+  else if (payloadIs(payload, len, "OFF"))
+    type = CMD_POWER_OFF;
+  else
+    return false;
+  return true;
+}
+
+bool resetWidthFromPayload(const char *payload, size_t len, uint16_t &widthMs)
+{
+  size_t digits = len > 0 && payload[0] == '-' ? 1 : 0;
+  if (digits == len || payload[digits] < '0' || payload[digits] > '9')
+  {
+    widthMs = RESET_PULSE_MS; // "PRESS", empty: the default pulse
+    return true;
+  }
+  // Numeric: taken as it is, like the ms parameter of POST /reset, so a
+  // width out of range (or a negative one) is refused, not clamped.
+  uint32_t v = digits ? 0 : payloadToUint(payload, len);
+  if (v < RESET_PULSE_MIN_MS || v > RESET_PULSE_MAX_MS)
+    return false;
+  widthMs = (uint16_t)v;
+  return true;
+}
+
+bool commandQueuePush(CommandQueue &q, const Command &cmd)
+{
+  uint32_t head = q.head.load(std::memory_order_relaxed);
+  uint32_t tail = q.tail.load(std::memory_order_acquire);
+  if (head - tail >= CMD_QUEUE_SIZE)
+  {
+    q.dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  q.slots[head & (CMD_QUEUE_SIZE - 1)] = cmd;
+  q.head.store(head + 1, std::memory_order_release);
+
+  uint32_t depth = head + 1 - tail;
+  if (depth > q.maxDepth.load(std::memory_order_relaxed))
+    q.maxDepth.store(depth, std::memory_order_relaxed);
+  return true;
+}
+
+bool commandQueuePop(CommandQueue &q, Command &cmd)
+{
+  uint32_t tail = q.tail.load(std::memory_order_relaxed);
+  if (tail == q.head.load(std::memory_order_acquire))
+    return false;
+  cmd = q.slots[tail & (CMD_QUEUE_SIZE - 1)];
+  q.tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+uint32_t commandQueueDepth(const CommandQueue &q)
+{
+  return q.head.load(std::memory_order_acquire) - q.tail.load(std::memory_order_acquire);
+}
+
+bool parsePowerSet(const char *payload, size_t len, Command &cmd)
+{
+  cmd.arg = 0;
+  return powerCommandFromPayload(payload, len, cmd.type);
+}
+
+bool parseResetSet(const char *payload, size_t len, Command &cmd)
+{
+  cmd.type = CMD_RESET;
+  return resetWidthFromPayload(payload, len, cmd.arg);
+}
+
+// Rule values are taken as they are, so anything but a plain number up to
+// 65535 is refused rather than read as 0 (which would disable the rule).
+static bool parseRuleSeconds(const char *payload, size_t len, CommandType type, Command &cmd)
+{
+  uint32_t v = 0;
+  if (len == 0 || len > 5)
+    return false;
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (payload[i] < '0' || payload[i] > '9')
+      return false;
+    v = v * 10 + (payload[i] - '0');
+  }
+  if (v > UINT16_MAX)
+    return false;
+  cmd.type = type;
+  cmd.arg = (uint16_t)v;
+  return true;
+}
+
+bool parseIdleOffSet(const char *payload, size_t len, Command &cmd)
+{
+  return parseRuleSeconds(payload, len, CMD_RULE_IDLE_OFF, cmd);
+}
+
+bool parseTuneTimeoutSet(const char *payload, size_t len, Command &cmd)
+{
+  return parseRuleSeconds(payload, len, CMD_RULE_TUNE_TIMEOUT, cmd);
+}
+
+bool parseNoResetTuningSet(const char *payload, size_t len, Command &cmd)
+{
+  cmd.type = CMD_RULE_NO_RESET_TUNING;
+  if (payloadIs(payload, len, "ON"))
+    cmd.arg = 1;
+  else if (payloadIs(payload, len, "OFF"))
+    cmd.arg = 0;
+  else
+    return false;
+  return true;
+}
+
+bool mqttCommand(const MqttTopics *topics, uint8_t channels, const char *topic, const char *payload, size_t len,
+                 Command &cmd)
+{
+  size_t topicLen = strlen(topic);
+  for (uint8_t ch = 0; ch < channels; ++ch)
+  {
+    // Channel 1's base is a prefix of the others'; the suffix match tells them apart.
+    if (!topicHasBase(topics[ch], topic, topicLen))
+      continue;
+    for (const Entity &e : ENTITIES)
+    {
+      if (e.commandTopic == TOPIC_NONE || !entityOnChannel(e, ch))
+        continue;
+      if (topicSuffixIs(topics[ch], (TopicId)e.commandTopic, topic, topicLen))
+      {
+        cmd.channel = ch;
+        return e.parse(payload, len, cmd);
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "hal.h"
+#include "mqtt_state.h"
+#include "rules.h"
+
+// Reset relay pulse width limits.
+const uint32_t RESET_PULSE_MS = 250;
+const uint32_t RESET_PULSE_MIN_MS = 50;
+const uint32_t RESET_PULSE_MAX_MS = 2000;
+
+enum CommandType : uint8_t
+{
+  CMD_POWER_ON,
+  CMD_POWER_OFF,
+  CMD_POWER_TOGGLE,
+  CMD_RESET,
+  CMD_RULE_IDLE_OFF,        // arg: seconds, 0 = off
+  CMD_RULE_TUNE_TIMEOUT,    // arg: seconds, 0 = off
+  CMD_RULE_NO_RESET_TUNING, // arg: 1 = on
+};
+
+// Rule commands are in RuleKind order.
+inline RuleKind ruleOfCommand(CommandType type)
+{
+  return (RuleKind)(type - CMD_RULE_IDLE_OFF);
+}
+
+extern const char *const COMMAND_NAME[]; // "power_on", ... in CommandType order
+
+const uint8_t TRACE_NONE = 0xFF;
+
+struct Command
+{
+  CommandType type;
+  uint8_t channel;
+  uint16_t arg;   // reset: pulse width in ms, rules: value
+  uint8_t trace;  // slot in the trace table (trace.h), TRACE_NONE if the command has no id
+  uint32_t rxUs;  // micros() when the producer received it
+};
+
+// Commands from the producers (MQTT callback, web task) to the control loop.
+// Single-producer ring: with several producers the caller serializes push
+// with its own lock. Only the consumer advances tail and it never locks.
+const uint32_t CMD_QUEUE_SIZE = 16; // power of two
+
+struct CommandQueue
+{
+  Command slots[CMD_QUEUE_SIZE];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+  std::atomic<uint32_t> dropped{0};
+  std::atomic<uint32_t> maxDepth{0};
+};
+
+bool commandQueuePush(CommandQueue &q, const Command &cmd);
+bool commandQueuePop(CommandQueue &q, Command &cmd);
+uint32_t commandQueueDepth(const CommandQueue &q);
+
+// Maps an incoming MQTT message to a command through the entity table, for
+// one of the channels' topic sets, without copying topic or payload; false
+// if it is not a command topic or the payload is unknown.
+bool mqttCommand(const MqttTopics *topics, uint8_t channels, const char *topic, const char *payload, size_t len,
+                 Command &cmd);
+
+// Switches the power relay for a power command; returns true if it changed.
+bool applyPowerCommand(HalGpio &gpio, uint8_t pin, CommandType type);
+
+// Command payloads are parsed in place from the char*/len the client hands over.
+bool payloadIs(const char *payload, size_t len, const char *literal);
+uint32_t payloadToUint(const char *payload, size_t len);
+
+// "ON" | "OFF" | "TOGGLE"; false for anything else.
+bool powerCommandFromPayload(const char *payload, size_t len, CommandType &type);
+
+// Numeric payload = pulse width in ms, false unless it is within
+// RESET_PULSE_MIN_MS..RESET_PULSE_MAX_MS; anything else uses the default.
+bool resetWidthFromPayload(const char *payload, size_t len, uint16_t &widthMs);
+
+// Command payload codecs of the entity table (entities.h).
+bool parsePowerSet(const char *payload, size_t len, Command &cmd);
+bool parseResetSet(const char *payload, size_t len, Command &cmd);
+bool parseIdleOffSet(const char *payload, size_t len, Command &cmd);       // seconds
+bool parseTuneTimeoutSet(const char *payload, size_t len, Command &cmd);   // seconds
+bool parseNoResetTuningSet(const char *payload, size_t len, Command &cmd); // "ON" | "OFF"
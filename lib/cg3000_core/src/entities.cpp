@@ -0,0 +1,134 @@
+#include "entities.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "journal.h" // crc32
+
+const char *const ENTITY_COMPONENT_NAME[ENTITY_COMPONENT_COUNT] = {"switch", "button", "binary_sensor", "sensor", "number"};
+
+uint8_t discoverySlotCount(uint8_t channels)
+{
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < ENTITY_COUNT; ++i)
+    n += ENTITIES[i].perChannel ? channels : 1;
+  return n;
+}
+
+const Entity &discoverySlot(uint8_t slot, uint8_t &channel)
+{
+  for (channel = 0;; ++channel)
+  {
+    for (uint8_t i = 0; i < ENTITY_COUNT; ++i)
+    {
+      if (!entityOnChannel(ENTITIES[i], channel))
+        continue;
+      if (slot == 0)
+        return ENTITIES[i];
+      slot--;
+    }
+  }
+}
+
+static int formatObjectId(char *buf, size_t len, const char *deviceId, const Entity &e, uint8_t channel)
+{
+  // Channel 1 keeps the ids of the single-channel firmware.
+  if (channel == 0)
+    return snprintf(buf, len, "%s_%s", deviceId, e.objectId);
+  return snprintf(buf, len, "%s_ch%u_%s", deviceId, channel + 1, e.objectId);
+}
+
+// Adds one snprintf result to n; false if it was cut off.
+static bool advance(int w, size_t len, size_t &n)
+{
+  if (w < 0 || (size_t)w >= len - n)
+    return false;
+  n += w;
+  return true;
+}
+
+size_t discoveryTopic(char *buf, size_t len, const char *deviceId, uint8_t slot)
+{
+  uint8_t channel;
+  const Entity &e = discoverySlot(slot, channel);
+  size_t n = 0;
+  if (!advance(snprintf(buf, len, "%s/%s/", DISCOVERY_PREFIX, ENTITY_COMPONENT_NAME[e.component]), len, n) ||
+      !advance(formatObjectId(buf + n, len - n, deviceId, e, channel), len, n) ||
+      !advance(snprintf(buf + n, len - n, "/config"), len, n))
+    return 0;
+  return n;
+}
+
+size_t discoveryPayload(char *buf, size_t len, const char *deviceId, const MqttTopics *topics, uint8_t slot)
+{
+  uint8_t channel;
+  const Entity &e = discoverySlot(slot, channel);
+  const MqttTopics &t = topics[channel];
+  size_t n = 0;
+  if (!advance(snprintf(buf, len, "{\"id\":\""), len, n) ||
+      !advance(formatObjectId(buf + n, len - n, deviceId, e, channel), len, n) ||
+      !advance(snprintf(buf + n, len - n, "\","), len, n))
+    return 0;
+  if (e.commandTopic != TOPIC_NONE &&
+      !advance(snprintf(buf + n, len - n, "\"cmd\":\"%s\",", t.topics[e.commandTopic]), len, n))
+    return 0;
+  if (e.stateTopic != TOPIC_NONE &&
+      !advance(snprintf(buf + n, len - n, "\"state\":\"%s\",", t.topics[e.stateTopic]), len, n))
+    return 0;
+  int w = snprintf(buf + n, len - n,
+                   "%s\"device\":{\"id\":\"%s\",\"manufacturer\":\"CG-3000\",\"model\":\"ESP32 Remote\","
+                   "\"name\":\"CG-3000 Remote\"}}",
+                   e.config, deviceId);
+  if (!advance(w, len, n))
+    return 0;
+  return n;
+}
+
+void discoveryReset(DiscoveryState &d)
+{
+  memset(d.retained, 0, sizeof(d.retained));
+}
+
+bool discoveryRetained(DiscoveryState &d, const char *deviceId, uint8_t channels, const char *topic,
+                       const char *payload, size_t len)
+{
+  size_t prefixLen = strlen(DISCOVERY_PREFIX);
+  if (strncmp(topic, DISCOVERY_PREFIX, prefixLen) != 0 || topic[prefixLen] != '/')
+    return false;
+  char buf[DISCOVERY_TOPIC_MAX];
+  uint8_t slots = discoverySlotCount(channels);
+  for (uint8_t slot = 0; slot < slots; ++slot)
+  {
+    if (discoveryTopic(buf, sizeof(buf), deviceId, slot) && strcmp(buf, topic) == 0)
+    {
+      d.retained[slot] = crc32(payload, len);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t discoveryPublish(DiscoveryState &d, HalMqtt &mqtt, const char *deviceId, const MqttTopics *topics,
+                         uint8_t channels)
+{
+  char topic[DISCOVERY_TOPIC_MAX];
+  char payload[DISCOVERY_PAYLOAD_MAX];
+  uint8_t sent = 0;
+  uint8_t slots = discoverySlotCount(channels);
+  for (uint8_t slot = 0; slot < slots; ++slot)
+  {
+    size_t n = discoveryPayload(payload, sizeof(payload), deviceId, topics, slot);
+    if (n == 0 || !discoveryTopic(topic, sizeof(topic), deviceId, slot))
+      continue;
+    if (crc32(payload, n) == d.retained[slot])
+    {
+      d.current++;
+      continue;
+    }
+    mqtt.publish(topic, payload, true);
+    d.retained[slot] = crc32(payload, n);
+    d.published++;
+    sent++;
+  }
+  return sent;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "control.h"
+#include "hal.h"
+#include "mqtt_state.h"
+
+// Every entity the remote exposes over MQTT, declared once. The table drives
+// the discovery configs, the command subscriptions and the command dispatch;
+// adding an entity is one line in ENTITIES.
+enum EntityComponent : uint8_t
+{
+  ENTITY_SWITCH,
+  ENTITY_BUTTON,
+  ENTITY_BINARY_SENSOR,
+  ENTITY_SENSOR,
+  ENTITY_NUMBER,
+  ENTITY_COMPONENT_COUNT
+};
+
+extern const char *const ENTITY_COMPONENT_NAME[ENTITY_COMPONENT_COUNT];
+
+const uint8_t TOPIC_NONE = TOPIC_COUNT;
+
+struct Entity
+{
+  const char *objectId; // discovery id is <deviceId>[_ch<n>]_<objectId>
+  EntityComponent component;
+  uint8_t stateTopic;   // TopicId or TOPIC_NONE
+  uint8_t commandTopic; // TopicId or TOPIC_NONE
+  bool (*parse)(const char *payload, size_t len, Command &cmd); // command payload codec
+  const char *config;   // further discovery members, each followed by a comma
+  bool perChannel;      // false: once per device, on channel 1's topics
+};
+
+constexpr Entity ENTITIES[] = {
+    {"power", ENTITY_SWITCH, TOPIC_POWER_STATE, TOPIC_POWER_SET, parsePowerSet, "", true},
+    {"reset", ENTITY_BUTTON, TOPIC_NONE, TOPIC_RESET_SET, parseResetSet, "", true},
+    {"tuning", ENTITY_BINARY_SENSOR, TOPIC_TUNING_STATE, TOPIC_NONE, nullptr, "", true},
+    {"lastreset", ENTITY_SENSOR, TOPIC_LASTRESET_STR, TOPIC_NONE, nullptr, "\"type\":\"timestamp\",", true},
+    {"tuneduration", ENTITY_SENSOR, TOPIC_TUNE_STATS, TOPIC_NONE, nullptr,
+     "\"type\":\"duration\",\"unit\":\"ms\",\"value\":\"avg\",", true},
+    {"time", ENTITY_SENSOR, TOPIC_TIME_EPOCH, TOPIC_NONE, nullptr, "\"type\":\"timestamp\",", false},
+    {"idleoff", ENTITY_NUMBER, TOPIC_IDLE_OFF_STATE, TOPIC_IDLE_OFF_SET, parseIdleOffSet,
+     "\"unit\":\"s\",\"min\":0,\"max\":65535,", true},
+    {"tunetimeout", ENTITY_NUMBER, TOPIC_TUNE_TIMEOUT_STATE, TOPIC_TUNE_TIMEOUT_SET, parseTuneTimeoutSet,
+     "\"unit\":\"s\",\"min\":0,\"max\":65535,", true},
+    {"noresettuning", ENTITY_SWITCH, TOPIC_NO_RESET_TUNING_STATE, TOPIC_NO_RESET_TUNING_SET, parseNoResetTuningSet, "",
+     true},
+};
+
+constexpr uint8_t ENTITY_COUNT = sizeof(ENTITIES) / sizeof(ENTITIES[0]);
+
+inline bool entityOnChannel(const Entity &e, uint8_t channel)
+{
+  return e.perChannel || channel == 0;
+}
+
+// Discovery configs (retained) live under DISCOVERY_PREFIX/<component>/<id>/config.
+// Slots enumerate them: channel 1's entities, then each further channel's
+// per-channel ones.
+const char *const DISCOVERY_PREFIX = "ham";
+const uint8_t DISCOVERY_MAX_SLOTS = ENTITY_COUNT * MAX_CHANNELS;
+const size_t DISCOVERY_TOPIC_MAX = 96;
+const size_t DISCOVERY_PAYLOAD_MAX = 384;
+
+uint8_t discoverySlotCount(uint8_t channels);
+const Entity &discoverySlot(uint8_t slot, uint8_t &channel);
+
+// Both return the length written, 0 if it did not fit.
+size_t discoveryTopic(char *buf, size_t len, const char *deviceId, uint8_t slot);
+size_t discoveryPayload(char *buf, size_t len, const char *deviceId, const MqttTopics *topics, uint8_t slot);
+
+// Configs are only republished when the broker's retained copy differs: after
+// connect the client subscribes to its own config topics, records the CRC of
+// every copy the broker returns (discoveryRetained) and, once they had time
+// to arrive, discoveryPublish sends the missing or outdated ones.
+struct DiscoveryState
+{
+  uint32_t retained[DISCOVERY_MAX_SLOTS]; // CRC-32 of the broker's copy, 0 = none seen
+  uint32_t published;                     // configs sent since boot
+  uint32_t current;                       // configs found up to date on the broker
+};
+
+void discoveryReset(DiscoveryState &d);
+
+// True if topic is one of this device's config topics (the message is consumed).
+bool discoveryRetained(DiscoveryState &d, const char *deviceId, uint8_t channels, const char *topic,
+                       const char *payload, size_t len);
+
+// Returns the number of configs published.
+uint8_t discoveryPublish(DiscoveryState &d, HalMqtt &mqtt, const char *deviceId, const MqttTopics *topics,
+                         uint8_t channels);
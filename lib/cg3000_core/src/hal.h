@@ -0,0 +1,57 @@
+#pragma once
+// Hardware abstraction for the portable control logic in this library.
+// The firmware implements it on Arduino/ESP-IDF (src/hal_esp32.h), the
+// native build on a simulated clock, scripted GPIO, an in-memory broker and
+// flash (src/native/hal_native.h).
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+class HalClock
+{
+public:
+  virtual ~HalClock() {}
+  virtual uint32_t millis() = 0;
+  virtual time_t now() = 0; // wall clock, below TIME_VALID_AFTER until NTP
+};
+
+class HalGpio
+{
+public:
+  virtual ~HalGpio() {}
+  virtual bool read(uint8_t pin) = 0;
+  virtual void write(uint8_t pin, bool high) = 0;
+};
+
+class HalMqtt
+{
+public:
+  virtual ~HalMqtt() {}
+  virtual bool connected() = 0;
+  virtual void publish(const char *topic, const char *payload, bool retain) = 0;
+};
+
+// Raw flash region (NOR semantics): eraseSector sets a whole sector to 0xFF,
+// write can only clear bits. Offsets are relative to the region.
+class HalFlash
+{
+public:
+  virtual ~HalFlash() {}
+  virtual bool read(uint32_t offset, void *buf, size_t len) = 0;
+  virtual bool write(uint32_t offset, const void *buf, size_t len) = 0;
+  virtual bool eraseSector(uint32_t offset) = 0;
+};
+
+// Inactive firmware slot, filled front to back. begin picks the slot and
+// prepares it, commit checks the image and makes it the one booted next,
+// abort discards what was written.
+class HalOtaSlot
+{
+public:
+  virtual ~HalOtaSlot() {}
+  virtual bool begin() = 0;
+  virtual uint32_t size() = 0;
+  virtual bool write(const void *data, size_t len) = 0;
+  virtual bool commit() = 0;
+  virtual void abort() = 0;
+};
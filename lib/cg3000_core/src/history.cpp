@@ -0,0 +1,83 @@
+#include "history.h"
+
+const char *const HISTORY_KIND_NAME[HIST_KIND_COUNT] = {
+    "tuning_start", "tuning_end", "power_on", "power_off", "reset",
+};
+
+uint32_t historyAdd(History &h, uint8_t channel, HistoryKind kind, uint32_t ms, uint32_t epoch, uint32_t arg)
+{
+  uint32_t seq = h.next++;
+  HistoryEvent &ev = h.events[seq & (HISTORY_SIZE - 1)];
+  ev.seq = seq;
+  ev.ms = ms;
+  ev.epoch = epoch;
+  ev.arg = arg;
+  ev.kind = kind;
+  ev.channel = channel;
+  return seq;
+}
+
+void historyTuning(History &h, uint8_t channel, bool active, uint32_t ms, uint32_t epoch)
+{
+  if (active)
+  {
+    h.tuning[channel] = true;
+    h.tuneStartMs[channel] = ms;
+    historyAdd(h, channel, HIST_TUNING_START, ms, epoch);
+    return;
+  }
+  // A release without a recorded start (line was active at boot) has no duration.
+  uint32_t duration = 0;
+  if (h.tuning[channel])
+  {
+    duration = ms - h.tuneStartMs[channel];
+    h.durations[channel][h.tuneCount[channel] % TUNE_WINDOW] = duration;
+    h.tuneCount[channel]++;
+  }
+  h.tuning[channel] = false;
+  historyAdd(h, channel, HIST_TUNING_END, ms, epoch, duration);
+}
+
+uint32_t historyOldest(const History &h)
+{
+  return h.next > HISTORY_SIZE ? h.next - HISTORY_SIZE : 0;
+}
+
+bool historyGet(const History &h, uint32_t seq, HistoryEvent &ev)
+{
+  if (seq >= h.next || seq < historyOldest(h))
+    return false;
+  ev = h.events[seq & (HISTORY_SIZE - 1)];
+  return true;
+}
+
+void tuneStats(const History &h, uint8_t channel, TuneStats &st)
+{
+  st = {};
+  st.count = h.tuneCount[channel];
+  uint8_t n = st.count < TUNE_WINDOW ? st.count : TUNE_WINDOW;
+  if (n == 0)
+    return;
+
+  // Insertion sort of at most TUNE_WINDOW values, cheap enough per cycle.
+  uint32_t sorted[TUNE_WINDOW];
+  uint64_t sum = 0;
+  for (uint8_t i = 0; i < n; ++i)
+  {
+    uint32_t v = h.durations[channel][i];
+    sum += v;
+    uint8_t j = i;
+    while (j > 0 && sorted[j - 1] > v)
+    {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = v;
+  }
+  st.minMs = sorted[0];
+  st.maxMs = sorted[n - 1];
+  st.avgMs = (uint32_t)(sum / n);
+  // nearest rank
+  st.p50Ms = sorted[(n * 50 + 99) / 100 - 1];
+  st.p90Ms = sorted[(n * 90 + 99) / 100 - 1];
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+
+#include "channel.h"
+
+// Tuning-cycle and relay history: a fixed ring of the last HISTORY_SIZE
+// events of all channels with millisecond timestamps, plus per channel the
+// durations of the last TUNE_WINDOW completed tuning cycles for rolling
+// statistics. Nothing here allocates; the caller serializes writers and
+// readers with its own lock.
+const uint32_t HISTORY_SIZE = 128; // power of two
+const uint8_t TUNE_WINDOW = 32;
+
+enum HistoryKind : uint8_t
+{
+  HIST_TUNING_START,
+  HIST_TUNING_END, // arg: cycle duration in ms
+  HIST_POWER_ON,
+  HIST_POWER_OFF,
+  HIST_RESET, // arg: pulse width in ms
+  HIST_KIND_COUNT
+};
+
+extern const char *const HISTORY_KIND_NAME[HIST_KIND_COUNT];
+
+struct HistoryEvent
+{
+  uint32_t seq;
+  uint32_t ms;    // millis() of the event (debounced edge for tuning)
+  uint32_t epoch; // wall clock seconds, 0 while NTP time is not valid
+  uint32_t arg;
+  HistoryKind kind;
+  uint8_t channel;
+};
+
+struct TuneStats
+{
+  uint32_t count; // completed cycles since boot
+  uint32_t minMs;
+  uint32_t avgMs;
+  uint32_t maxMs;
+  uint32_t p50Ms;
+  uint32_t p90Ms;
+};
+
+struct History
+{
+  HistoryEvent events[HISTORY_SIZE];
+  uint32_t next; // seq of the next event
+  bool tuning[MAX_CHANNELS];
+  uint32_t tuneStartMs[MAX_CHANNELS];
+  uint32_t durations[MAX_CHANNELS][TUNE_WINDOW];
+  uint32_t tuneCount[MAX_CHANNELS];
+};
+
+uint32_t historyAdd(History &h, uint8_t channel, HistoryKind kind, uint32_t ms, uint32_t epoch, uint32_t arg = 0);
+
+// Records a debounced tuning transition; a falling edge closes the cycle and
+// feeds its duration into the channel's statistics window.
+void historyTuning(History &h, uint8_t channel, bool active, uint32_t ms, uint32_t epoch);
+
+// Oldest seq still in the ring; events before it were overwritten.
+uint32_t historyOldest(const History &h);
+bool historyGet(const History &h, uint32_t seq, HistoryEvent &ev);
+
+// Statistics over the last TUNE_WINDOW cycles (all zero before the first).
+void tuneStats(const History &h, uint8_t channel, TuneStats &st);
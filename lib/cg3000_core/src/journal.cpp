@@ -0,0 +1,131 @@
+#include "journal.h"
+
+#include <stddef.h>
+#include <string.h>
+
+uint32_t crc32(const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--)
+  {
+    crc ^= *p++;
+    for (uint8_t bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+static uint32_t slotOffset(uint8_t sector, uint16_t slot)
+{
+  return sector * JOURNAL_SECTOR_SIZE + slot * sizeof(JournalRecord);
+}
+
+static bool slotErased(HalFlash &flash, uint8_t sector, uint16_t slot)
+{
+  uint8_t raw[sizeof(JournalRecord)];
+  if (!flash.read(slotOffset(sector, slot), raw, sizeof(raw)))
+    return false;
+  for (uint8_t b : raw)
+  {
+    if (b != 0xFF)
+      return false;
+  }
+  return true;
+}
+
+static bool readRecord(HalFlash &flash, uint8_t sector, uint16_t slot, JournalRecord &rec)
+{
+  return flash.read(slotOffset(sector, slot), &rec, sizeof(rec)) && rec.seq != 0xFFFFFFFF &&
+         rec.crc == crc32(&rec, offsetof(JournalRecord, crc));
+}
+
+// Slots are written in order, so the erased ones form the tail of a sector.
+static uint16_t firstErasedSlot(HalFlash &flash, uint8_t sector)
+{
+  uint16_t lo = 0;
+  uint16_t hi = JOURNAL_SLOTS;
+  while (lo < hi)
+  {
+    uint16_t mid = (lo + hi) / 2;
+    if (slotErased(flash, sector, mid))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+bool journalOpen(Journal &j, HalFlash &flash, JournalState &restored)
+{
+  j = {};
+  j.flash = &flash;
+  // Without a valid record the first write erases sector 0 (it may hold
+  // anything from an earlier partition layout).
+  j.sector = JOURNAL_SECTORS - 1;
+  j.nextSlot = JOURNAL_SLOTS;
+  restored = {};
+
+  for (uint8_t sector = 0; sector < JOURNAL_SECTORS; ++sector)
+  {
+    uint16_t free = firstErasedSlot(flash, sector);
+    // Walk back over records torn by a reset during the write.
+    for (uint16_t slot = free; slot > 0; --slot)
+    {
+      JournalRecord rec;
+      if (!readRecord(flash, sector, slot - 1, rec))
+        continue;
+      if (rec.seq > j.seq)
+      {
+        j.seq = rec.seq;
+        j.sector = sector;
+        j.nextSlot = free;
+        j.saved = rec.state;
+      }
+      break;
+    }
+  }
+  restored = j.saved;
+  return j.seq != 0;
+}
+
+bool journalUpdate(Journal &j, const JournalState &st, uint32_t nowMs, bool force)
+{
+  if (!j.flash || memcmp(&st, &j.saved, sizeof(st)) == 0)
+    return false;
+  bool stateChanged =
+      st.power != j.saved.power || memcmp(st.lastReset, j.saved.lastReset, sizeof(st.lastReset)) != 0;
+  uint32_t interval = stateChanged ? JOURNAL_STATE_FLUSH_MS : JOURNAL_COUNTER_FLUSH_MS;
+  if (!force && j.seq != 0 && nowMs - j.lastFlushMs < interval)
+    return false;
+
+  if (j.nextSlot >= JOURNAL_SLOTS)
+  {
+    uint8_t other = (j.sector + 1) % JOURNAL_SECTORS;
+    if (!j.flash->eraseSector(other * JOURNAL_SECTOR_SIZE))
+    {
+      j.errors++;
+      return false;
+    }
+    j.sector = other;
+    j.nextSlot = 0;
+    j.compactions++;
+  }
+
+  JournalRecord rec;
+  rec.seq = j.seq + 1;
+  rec.state = st;
+  rec.crc = crc32(&rec, offsetof(JournalRecord, crc));
+  bool ok = j.flash->write(slotOffset(j.sector, j.nextSlot), &rec, sizeof(rec));
+  j.nextSlot++; // a failed write may have cleared bits, the slot is not reused
+  j.lastFlushMs = nowMs;
+  if (!ok)
+  {
+    j.errors++;
+    return false;
+  }
+  j.seq = rec.seq;
+  j.saved = st;
+  j.flushes++;
+  return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+
+#include "channel.h"
+#include "hal.h"
+
+// Append-only state journal in two flash sectors. Every record is a full,
+// CRC-checked copy of the state, so restoring means finding the newest valid
+// record (a binary search for the first erased slot per sector). When the
+// active sector is full the other one is erased and starts with the current
+// state; an interrupted write or erase leaves the older record readable.
+const uint32_t JOURNAL_SECTOR_SIZE = 4096;
+const uint8_t JOURNAL_SECTORS = 2;
+
+// Writes are coalesced: a changed relay state or reset time goes out at most
+// once per JOURNAL_STATE_FLUSH_MS, counters alone once per JOURNAL_COUNTER_FLUSH_MS.
+const uint32_t JOURNAL_STATE_FLUSH_MS = 2000;
+const uint32_t JOURNAL_COUNTER_FLUSH_MS = 60000;
+
+// Counters are lifetime totals over all channels.
+struct JournalState
+{
+  uint32_t lastReset[MAX_CHANNELS]; // epoch of the last reset pulse, 0 = none
+  uint32_t boots;
+  uint32_t resetPulses;
+  uint32_t powerSwitches;
+  uint32_t tuneCycles;
+  uint8_t power; // bit n = power relay of channel n
+  uint8_t reserved[3];
+};
+
+struct JournalRecord
+{
+  uint32_t seq;
+  JournalState state;
+  uint32_t crc; // CRC-32 over seq and state
+};
+
+const uint16_t JOURNAL_SLOTS = JOURNAL_SECTOR_SIZE / sizeof(JournalRecord);
+
+struct Journal
+{
+  HalFlash *flash;
+  uint8_t sector;    // sector of the newest record
+  uint16_t nextSlot; // JOURNAL_SLOTS = sector full
+  uint32_t seq;      // of the newest record, 0 = none
+  JournalState saved;
+  bool pending;
+  uint32_t pendingSinceMs;
+  uint32_t lastFlushMs;
+  uint32_t flushes;
+  uint32_t compactions;
+  uint32_t errors;
+};
+
+uint32_t crc32(const void *data, size_t len);
+
+// Finds the newest valid record; false (and a zeroed state) on an empty or
+// unreadable journal.
+bool journalOpen(Journal &j, HalFlash &flash, JournalState &restored);
+
+// Takes the current state and writes it once it differs from the last record
+// and its coalescing interval passed; force skips the interval. Returns true
+// if a record was written.
+bool journalUpdate(Journal &j, const JournalState &st, uint32_t nowMs, bool force = false);
@@ -0,0 +1,83 @@
+#include "logring.h"
+
+#include <stdio.h>
+#include <string.h>
+
+const char *const LOG_LEVEL_NAME[LOG_LEVEL_COUNT] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+// Approximate under contention (two tasks on one site may both reset the
+// window); it only has to keep a flood from filling the ring.
+static bool siteAllows(LogSite &site, uint32_t nowMs, uint32_t &suppressed)
+{
+  if (nowMs - site.windowStartMs.load(std::memory_order_relaxed) >= LOG_SITE_WINDOW_MS)
+  {
+    site.windowStartMs.store(nowMs, std::memory_order_relaxed);
+    site.count.store(0, std::memory_order_relaxed);
+  }
+  if (site.count.fetch_add(1, std::memory_order_relaxed) >= LOG_SITE_BURST)
+  {
+    site.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+  return true;
+}
+
+uint32_t logWriteV(LogRing &ring, LogSite *site, uint32_t nowMs, LogLevel level, const char *fmt, va_list args)
+{
+  uint32_t suppressed = 0;
+  if (site && !siteAllows(*site, nowMs, suppressed))
+  {
+    ring.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return UINT32_MAX;
+  }
+
+  uint32_t seq = ring.next.fetch_add(1, std::memory_order_relaxed);
+  LogEntry &e = ring.entries[seq & (LOG_SIZE - 1)];
+  e.done.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.ms = nowMs;
+  e.level = level;
+  int n = vsnprintf(e.text, sizeof(e.text), fmt, args);
+  if (suppressed > 0 && n >= 0 && (size_t)n < sizeof(e.text))
+    snprintf(e.text + n, sizeof(e.text) - n, " (%lu suppressed)", (unsigned long)suppressed);
+  e.done.store(seq + 1, std::memory_order_release);
+  return seq;
+}
+
+uint32_t logWrite(LogRing &ring, LogSite *site, uint32_t nowMs, LogLevel level, const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  uint32_t seq = logWriteV(ring, site, nowMs, level, fmt, args);
+  va_end(args);
+  return seq;
+}
+
+uint32_t logOldest(const LogRing &ring)
+{
+  uint32_t next = ring.next.load(std::memory_order_acquire);
+  return next > LOG_SIZE ? next - LOG_SIZE : 0;
+}
+
+bool logRead(const LogRing &ring, uint32_t seq, LogLine &line)
+{
+  const LogEntry &e = ring.entries[seq & (LOG_SIZE - 1)];
+  if (e.done.load(std::memory_order_acquire) != seq + 1)
+    return false;
+  line.ms = e.ms;
+  line.level = e.level;
+  memcpy(line.text, e.text, sizeof(line.text));
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (e.done.load(std::memory_order_relaxed) != seq + 1)
+    return false;
+  line.text[sizeof(line.text) - 1] = '\0';
+  line.seq = seq;
+  return true;
+}
+
+int formatLogLine(const LogLine &line, char *buf, size_t len)
+{
+  return snprintf(buf, len, "%lu %lu %s %s\n", (unsigned long)line.seq, (unsigned long)line.ms,
+                  LOG_LEVEL_NAME[line.level], line.text);
+}
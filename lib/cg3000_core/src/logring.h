@@ -0,0 +1,75 @@
+#pragma once
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Diagnostics log: a fixed ring of formatted lines in RAM that any task can
+// write without locking or blocking. A writer claims a slot with one atomic
+// add, formats in place and marks the slot complete by storing its sequence
+// number last; a reader keeps its copy only if that number did not change
+// while copying (a writer lapping the ring may reuse the slot).
+const uint32_t LOG_SIZE = 64; // power of two
+const size_t LOG_TEXT_MAX = 96;
+
+enum LogLevel : uint8_t
+{
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARN,
+  LOG_ERROR,
+  LOG_LEVEL_COUNT
+};
+
+extern const char *const LOG_LEVEL_NAME[LOG_LEVEL_COUNT];
+
+struct LogEntry
+{
+  std::atomic<uint32_t> done{0}; // seq + 1 once complete, 0 while written
+  uint32_t ms;
+  LogLevel level;
+  char text[LOG_TEXT_MAX];
+};
+
+struct LogLine
+{
+  uint32_t seq;
+  uint32_t ms;
+  LogLevel level;
+  char text[LOG_TEXT_MAX];
+};
+
+struct LogRing
+{
+  LogEntry entries[LOG_SIZE];
+  std::atomic<uint32_t> next{0};
+  std::atomic<uint32_t> suppressed{0}; // lines dropped by call-site rate limits
+};
+
+// Rate limit per call site: at most LOG_SITE_BURST lines per
+// LOG_SITE_WINDOW_MS; the first line after that reports how many were dropped.
+const uint32_t LOG_SITE_BURST = 5;
+const uint32_t LOG_SITE_WINDOW_MS = 10000;
+
+struct LogSite
+{
+  std::atomic<uint32_t> windowStartMs{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> suppressed{0};
+};
+
+// Returns the line's seq, or UINT32_MAX if the site's rate limit dropped it.
+// site may be null (no limit).
+uint32_t logWrite(LogRing &ring, LogSite *site, uint32_t nowMs, LogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+uint32_t logWriteV(LogRing &ring, LogSite *site, uint32_t nowMs, LogLevel level, const char *fmt, va_list args);
+
+// Oldest seq that may still be in the ring.
+uint32_t logOldest(const LogRing &ring);
+
+// Copies line seq; false if it was overwritten or is still being written.
+bool logRead(const LogRing &ring, uint32_t seq, LogLine &line);
+
+// "<seq> <ms> <LEVEL> <text>\n"; returns the length.
+int formatLogLine(const LogLine &line, char *buf, size_t len);
@@ -0,0 +1,43 @@
+#include "metrics.h"
+
+#include <stdio.h>
+
+const uint32_t LATENCY_BUCKET_US[LATENCY_BUCKETS] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, UINT32_MAX,
+};
+
+void histogramObserve(LatencyHistogram &h, uint32_t us)
+{
+  uint8_t i = 0;
+  while (us > LATENCY_BUCKET_US[i])
+    i++; // the last bound is UINT32_MAX, so this always stops
+  h.buckets[i]++;
+  h.count++;
+  h.sumUs += us;
+  if (us > h.maxUs)
+    h.maxUs = us;
+}
+
+size_t formatHistogram(char *buf, size_t len, const char *name, const char *labels, const LatencyHistogram &h)
+{
+  size_t n = 0;
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i < LATENCY_BUCKETS; ++i)
+  {
+    cumulative += h.buckets[i];
+    int w;
+    if (i + 1 < LATENCY_BUCKETS)
+      w = snprintf(buf + n, len - n, "%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, LATENCY_BUCKET_US[i] / 1e6,
+                   (unsigned long)cumulative);
+    else
+      w = snprintf(buf + n, len - n, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, (unsigned long)cumulative);
+    if (w < 0 || (size_t)w >= len - n)
+      return 0;
+    n += w;
+  }
+  int w = snprintf(buf + n, len - n, "%s_sum{%s} %.6f\n%s_count{%s} %lu\n", name, labels, h.sumUs / 1e6, name,
+                   labels, (unsigned long)h.count);
+  if (w < 0 || (size_t)w >= len - n)
+    return 0;
+  return n + w;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-bucket latency histogram. Each histogram has a single writer, so
+// observing is a few adds without locking; a scrape may see a bucket and the
+// sum from slightly different moments, which is fine for monitoring.
+const uint8_t LATENCY_BUCKETS = 12;
+extern const uint32_t LATENCY_BUCKET_US[LATENCY_BUCKETS]; // upper bounds, last one is +Inf
+
+struct LatencyHistogram
+{
+  uint32_t buckets[LATENCY_BUCKETS]; // per bucket, not cumulative
+  uint32_t count;
+  uint64_t sumUs;
+  uint32_t maxUs;
+};
+
+void histogramObserve(LatencyHistogram &h, uint32_t us);
+
+// Appends one labelled histogram in Prometheus text format (cumulative
+// buckets in seconds, _sum and _count); returns the bytes written, 0 if
+// it does not fit. Needs about 100 bytes per bucket for short labels.
+size_t formatHistogram(char *buf, size_t len, const char *name, const char *labels, const LatencyHistogram &h);
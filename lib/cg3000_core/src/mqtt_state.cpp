@@ -0,0 +1,162 @@
+#include "mqtt_state.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Optional: also publish power/tuning/lastReset as one compact JSON topic.
+#ifndef MQTT_JSON_STATE
+#define MQTT_JSON_STATE 0
+#endif
+
+const char *const TOPIC_SUFFIX[TOPIC_COUNT] = {
+    "/power/state",
+    "/power/set",
+    "/tuning/state",
+    "/lastReset/str",
+    "/time/str",
+    "/reset/set",
+    "/time/epoch",
+    "/state",
+    "/tuning/duration",
+    "/log",
+    "/rules/idle_off/set",
+    "/rules/idle_off/state",
+    "/rules/tune_timeout/set",
+    "/rules/tune_timeout/state",
+    "/rules/no_reset_tuning/set",
+    "/rules/no_reset_tuning/state",
+    "/ack",
+    "/stall",
+};
+
+void buildTopics(MqttTopics &t, const char *deviceId, uint8_t channel)
+{
+  if (channel == 0)
+    t.baseLen = snprintf(t.base, sizeof(t.base), "cg3000/%s", deviceId);
+  else
+    t.baseLen = snprintf(t.base, sizeof(t.base), "cg3000/%s/ch%u", deviceId, channel + 1);
+  for (uint8_t i = 0; i < TOPIC_COUNT; ++i)
+    t.len[i] = snprintf(t.topics[i], TOPIC_MAX_LEN, "%s%s", t.base, TOPIC_SUFFIX[i]);
+}
+
+bool topicHasBase(const MqttTopics &t, const char *topic, size_t topicLen)
+{
+  return topicLen > t.baseLen && memcmp(topic, t.base, t.baseLen) == 0;
+}
+
+bool topicSuffixIs(const MqttTopics &t, TopicId id, const char *topic, size_t topicLen)
+{
+  return t.len[id] == topicLen && memcmp(topic + t.baseLen, t.topics[id] + t.baseLen, topicLen - t.baseLen) == 0;
+}
+
+uint8_t stateChanges(const StatusSnapshot &a, const StatusSnapshot &b, uint8_t channel)
+{
+  uint8_t changes = 0;
+  if (a.power[channel] != b.power[channel])
+    changes |= CHANGE_POWER;
+  if (a.tuning[channel] != b.tuning[channel])
+    changes |= CHANGE_TUNING;
+  // lastResetStr depends on time validity as well
+  if (a.lastReset[channel] != b.lastReset[channel] || a.timeValid != b.timeValid)
+    changes |= CHANGE_LASTRESET;
+  // the statistics only move when a tuning cycle completes
+  if (a.tune[channel].count != b.tune[channel].count)
+    changes |= CHANGE_TUNE_STATS;
+  if (memcmp(&a.rules[channel], &b.rules[channel], sizeof(RuleConfig)) != 0)
+    changes |= CHANGE_RULES;
+  return changes;
+}
+
+static void publish(MqttPublisher &pub, HalMqtt &mqtt, const MqttTopics &topics, TopicId id, const char *payload)
+{
+  mqtt.publish(topics.topics[id], payload, true);
+  pub.publishCount[id]++;
+}
+
+bool mqttPublishChanges(MqttPublisher &pub, HalMqtt &mqtt, const MqttTopics *topics, const StatusSnapshot &st,
+                        bool forceAll, uint32_t nowMs)
+{
+  if (!mqtt.connected())
+    return false;
+
+  bool all = forceAll || !pub.initialDone || pub.published.channels != st.channels;
+  uint8_t changes[MAX_CHANNELS];
+  uint8_t any = 0;
+  for (uint8_t ch = 0; ch < st.channels; ++ch)
+  {
+    changes[ch] = all ? (uint8_t)CHANGE_ALL : stateChanges(st, pub.published, ch);
+    any |= changes[ch];
+  }
+  if (any == 0)
+  {
+    pub.changePending = false;
+    return false;
+  }
+
+  if (!all)
+  {
+    if (!pub.changePending)
+    {
+      pub.changePending = true;
+      pub.changeSinceMs = nowMs;
+    }
+    if (nowMs - pub.changeSinceMs < MQTT_COALESCE_MS)
+      return false;
+  }
+  pub.changePending = false;
+
+  for (uint8_t ch = 0; ch < st.channels; ++ch)
+  {
+    const MqttTopics &t = topics[ch];
+    if (changes[ch] & CHANGE_POWER)
+      publish(pub, mqtt, t, TOPIC_POWER_STATE, st.power[ch] ? "ON" : "OFF");
+    if (changes[ch] & CHANGE_TUNING)
+      publish(pub, mqtt, t, TOPIC_TUNING_STATE, st.tuning[ch] ? "ON" : "OFF");
+    if (changes[ch] & CHANGE_LASTRESET)
+      publish(pub, mqtt, t, TOPIC_LASTRESET_STR, st.lastResetStr[ch]);
+    if (changes[ch] & CHANGE_TUNE_STATS)
+    {
+      const TuneStats &tune = st.tune[ch];
+      char json[112];
+      snprintf(json, sizeof(json), "{\"count\":%lu,\"min\":%lu,\"avg\":%lu,\"max\":%lu,\"p50\":%lu,\"p90\":%lu}",
+               (unsigned long)tune.count, (unsigned long)tune.minMs, (unsigned long)tune.avgMs,
+               (unsigned long)tune.maxMs, (unsigned long)tune.p50Ms, (unsigned long)tune.p90Ms);
+      publish(pub, mqtt, t, TOPIC_TUNE_STATS, json);
+    }
+    if (changes[ch] & CHANGE_RULES)
+    {
+      const RuleConfig &rules = st.rules[ch];
+      char seconds[8];
+      snprintf(seconds, sizeof(seconds), "%u", rules.value[RULE_IDLE_OFF]);
+      publish(pub, mqtt, t, TOPIC_IDLE_OFF_STATE, seconds);
+      snprintf(seconds, sizeof(seconds), "%u", rules.value[RULE_TUNE_TIMEOUT]);
+      publish(pub, mqtt, t, TOPIC_TUNE_TIMEOUT_STATE, seconds);
+      publish(pub, mqtt, t, TOPIC_NO_RESET_TUNING_STATE, rules.value[RULE_NO_RESET_TUNING] ? "ON" : "OFF");
+    }
+
+#if MQTT_JSON_STATE
+    if (changes[ch] != 0)
+    {
+      char json[96];
+      snprintf(json, sizeof(json), "{\"power\":\"%s\",\"tuning\":\"%s\",\"lastReset\":%ld}",
+               st.power[ch] ? "ON" : "OFF", st.tuning[ch] ? "ON" : "OFF", (long)st.lastReset[ch]);
+      publish(pub, mqtt, t, TOPIC_STATE_JSON, json);
+    }
+#endif
+  }
+
+  if (all)
+  {
+    publish(pub, mqtt, topics[0], TOPIC_TIME_STR, st.timeStr);
+    if (st.timeValid)
+    {
+      char epoch[16];
+      snprintf(epoch, sizeof(epoch), "%ld", (long)st.now);
+      publish(pub, mqtt, topics[0], TOPIC_TIME_EPOCH, epoch);
+    }
+  }
+
+  pub.published = st;
+  pub.initialDone = true;
+  return true;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "status.h"
+
+// All MQTT topics are built once at startup (buildTopics) and reused for
+// every publish, subscribe and incoming-message match. Each channel has its
+// own set: channel 1 under cg3000/<deviceId>, channel n under
+// cg3000/<deviceId>/ch<n>. Device-wide topics (time, state JSON) are only
+// published from channel 1's set.
+enum TopicId : uint8_t
+{
+  TOPIC_POWER_STATE,
+  TOPIC_POWER_SET,
+  TOPIC_TUNING_STATE,
+  TOPIC_LASTRESET_STR,
+  TOPIC_TIME_STR,
+  TOPIC_RESET_SET,
+  TOPIC_TIME_EPOCH,
+  TOPIC_STATE_JSON,
+  TOPIC_TUNE_STATS,
+  TOPIC_LOG,
+  TOPIC_IDLE_OFF_SET,
+  TOPIC_IDLE_OFF_STATE,
+  TOPIC_TUNE_TIMEOUT_SET,
+  TOPIC_TUNE_TIMEOUT_STATE,
+  TOPIC_NO_RESET_TUNING_SET,
+  TOPIC_NO_RESET_TUNING_STATE,
+  TOPIC_ACK,
+  TOPIC_STALL,
+  TOPIC_COUNT
+};
+
+extern const char *const TOPIC_SUFFIX[TOPIC_COUNT];
+
+const size_t TOPIC_MAX_LEN = 64;
+
+struct MqttTopics
+{
+  char base[TOPIC_MAX_LEN]; // z.B. cg3000/cg3000-ABCDEF
+  size_t baseLen;
+  char topics[TOPIC_COUNT][TOPIC_MAX_LEN];
+  uint8_t len[TOPIC_COUNT];
+};
+
+void buildTopics(MqttTopics &t, const char *deviceId, uint8_t channel = 0);
+
+// Every command topic shares the base prefix, so callers match that once and
+// then compare only suffix lengths before touching the remaining bytes.
+bool topicHasBase(const MqttTopics &t, const char *topic, size_t topicLen);
+bool topicSuffixIs(const MqttTopics &t, TopicId id, const char *topic, size_t topicLen);
+
+// State topics go out only when their value changed; changes within
+// MQTT_COALESCE_MS are gathered into one publish round. Time is not a state
+// change: it goes out with the full set on connect and on every heartbeat.
+const uint32_t MQTT_COALESCE_MS = 100;
+
+enum StateChange : uint8_t
+{
+  CHANGE_POWER = 1 << 0,
+  CHANGE_TUNING = 1 << 1,
+  CHANGE_LASTRESET = 1 << 2,
+  CHANGE_TUNE_STATS = 1 << 3,
+  CHANGE_RULES = 1 << 4,
+  CHANGE_ALL = CHANGE_POWER | CHANGE_TUNING | CHANGE_LASTRESET | CHANGE_TUNE_STATS | CHANGE_RULES,
+};
+
+struct MqttPublisher
+{
+  StatusSnapshot published;
+  // per topic, summed over all channels
+  bool initialDone;
+  bool changePending;
+  uint32_t changeSinceMs;
+  uint32_t publishCount[TOPIC_COUNT];
+};
+
+uint8_t stateChanges(const StatusSnapshot &a, const StatusSnapshot &b, uint8_t channel);
+
+// Publishes what changed since the last round, or everything for forceAll
+// and the first round after connect; returns true if anything went out.
+// topics holds one set per channel (st.channels entries).
+bool mqttPublishChanges(MqttPublisher &pub, HalMqtt &mqtt, const MqttTopics *topics, const StatusSnapshot &st,
+                        bool forceAll, uint32_t nowMs);
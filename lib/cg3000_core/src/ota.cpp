@@ -0,0 +1,114 @@
+#include "ota.h"
+
+#include <string.h>
+
+const char *const OTA_STATE_NAME[OTA_STATE_COUNT] = {"idle", "receiving", "verified", "failed"};
+
+bool otaBegin(OtaUpdate &u, HalOtaSlot &slot, const char *sha256Hex, uint32_t nowMs)
+{
+  u.error = nullptr;
+  u.fill = 0;
+  u.received = 0;
+  u.chunks = 0;
+  u.startMs = nowMs;
+  u.endMs = 0;
+  u.state = OTA_RECEIVING;
+  if (!sha256FromHex(sha256Hex, u.expected))
+  {
+    u.state = OTA_FAILED;
+    u.error = "sha256 argument missing or malformed";
+    u.endMs = nowMs;
+    return false;
+  }
+  if (!slot.begin())
+  {
+    otaAbort(u, slot, "no update slot", nowMs);
+    return false;
+  }
+  sha256Init(u.sha);
+  return true;
+}
+
+static bool flushChunk(OtaUpdate &u, HalOtaSlot &slot, uint32_t nowMs)
+{
+  if (u.fill == 0)
+    return true;
+  if (!slot.write(u.chunk, u.fill))
+  {
+    otaAbort(u, slot, "flash write failed", nowMs);
+    return false;
+  }
+  u.chunks++;
+  u.fill = 0;
+  return true;
+}
+
+bool otaWrite(OtaUpdate &u, HalOtaSlot &slot, const uint8_t *data, size_t len, uint32_t nowMs)
+{
+  if (u.state != OTA_RECEIVING)
+    return false;
+  if (u.received + len > slot.size())
+  {
+    otaAbort(u, slot, "image larger than the update slot", nowMs);
+    return false;
+  }
+  sha256Update(u.sha, data, len);
+  u.received += len;
+  while (len > 0)
+  {
+    size_t take = len < OTA_CHUNK_SIZE - u.fill ? len : OTA_CHUNK_SIZE - u.fill;
+    memcpy(u.chunk + u.fill, data, take);
+    u.fill += take;
+    data += take;
+    len -= take;
+    if (u.fill == OTA_CHUNK_SIZE && !flushChunk(u, slot, nowMs))
+      return false;
+  }
+  return true;
+}
+
+bool otaFinish(OtaUpdate &u, HalOtaSlot &slot, uint32_t nowMs)
+{
+  if (u.state != OTA_RECEIVING || !flushChunk(u, slot, nowMs))
+    return false;
+  uint8_t digest[SHA256_SIZE];
+  sha256Final(u.sha, digest);
+  if (memcmp(digest, u.expected, SHA256_SIZE) != 0)
+  {
+    otaAbort(u, slot, "SHA-256 mismatch", nowMs);
+    return false;
+  }
+  if (!slot.commit())
+  {
+    u.state = OTA_FAILED;
+    u.error = "image rejected by the bootloader check";
+    u.endMs = nowMs;
+    return false;
+  }
+  u.state = OTA_VERIFIED;
+  u.endMs = nowMs;
+  return true;
+}
+
+void otaAbort(OtaUpdate &u, HalOtaSlot &slot, const char *error, uint32_t nowMs)
+{
+  if (u.state != OTA_RECEIVING)
+    return;
+  slot.abort();
+  u.state = OTA_FAILED;
+  u.error = error;
+  u.endMs = nowMs;
+}
+
+uint32_t otaElapsedMs(const OtaUpdate &u, uint32_t nowMs)
+{
+  if (u.state == OTA_IDLE)
+    return 0;
+  return (u.state == OTA_RECEIVING ? nowMs : u.endMs) - u.startMs;
+}
+
+uint32_t otaBytesPerSec(const OtaUpdate &u, uint32_t nowMs)
+{
+  uint32_t ms = otaElapsedMs(u, nowMs);
+  return ms ? (uint32_t)((uint64_t)u.received * 1000 / ms) : 0;
+}
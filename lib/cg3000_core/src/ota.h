@@ -0,0 +1,50 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "sha256.h"
+
+// Firmware update streamed into the inactive slot. Received data is hashed
+// as it arrives and collected into OTA_CHUNK_SIZE blocks (one flash sector),
+// each written as soon as it is full, so the image is never held in RAM.
+// The slot is only committed when the SHA-256 of everything received
+// matches the one the uploader announced.
+const size_t OTA_CHUNK_SIZE = 4096;
+
+enum OtaState : uint8_t
+{
+  OTA_IDLE,
+  OTA_RECEIVING,
+  OTA_VERIFIED, // committed, boots after the restart
+  OTA_FAILED,
+  OTA_STATE_COUNT
+};
+
+extern const char *const OTA_STATE_NAME[OTA_STATE_COUNT];
+
+struct OtaUpdate
+{
+  OtaState state;
+  const char *error; // why the last update failed, nullptr otherwise
+  uint8_t expected[SHA256_SIZE];
+  Sha256 sha;
+  uint8_t chunk[OTA_CHUNK_SIZE];
+  size_t fill;       // bytes in chunk
+  uint32_t received; // image bytes taken so far
+  uint32_t chunks;   // blocks written to the slot
+  uint32_t startMs;
+  uint32_t endMs;    // when it was verified or failed
+};
+
+// sha256Hex is the expected digest as 64 hex digits.
+bool otaBegin(OtaUpdate &u, HalOtaSlot &slot, const char *sha256Hex, uint32_t nowMs);
+
+// Each returns false once the update failed (error says why); the slot is
+// then already aborted and further data is ignored.
+bool otaWrite(OtaUpdate &u, HalOtaSlot &slot, const uint8_t *data, size_t len, uint32_t nowMs);
+bool otaFinish(OtaUpdate &u, HalOtaSlot &slot, uint32_t nowMs); // writes the last block, verifies, commits
+void otaAbort(OtaUpdate &u, HalOtaSlot &slot, const char *error, uint32_t nowMs);
+
+uint32_t otaElapsedMs(const OtaUpdate &u, uint32_t nowMs);
+uint32_t otaBytesPerSec(const OtaUpdate &u, uint32_t nowMs);
@@ -0,0 +1,112 @@
+#include "rules.h"
+
+#include <string.h>
+
+const char *const RULE_NAME[RULE_COUNT] = {"idle_off", "tune_timeout", "no_reset_tuning"};
+
+static uint8_t timerId(uint8_t channel, RuleKind rule)
+{
+  return channel * RULE_COUNT + rule;
+}
+
+// Moves the engine clock to nowMs in whole ticks; a counter instead of
+// nowMs / RULES_TICK_MS keeps ticks contiguous across the millis() wrap.
+static void updateTick(RuleEngine &e, uint32_t nowMs)
+{
+  uint32_t ticks = (nowMs - e.tickMs) / RULES_TICK_MS;
+  e.tick += ticks;
+  e.tickMs += ticks * RULES_TICK_MS;
+}
+
+static uint32_t deadlineAfter(const RuleEngine &e, uint16_t seconds)
+{
+  return e.tick + (seconds * 1000UL + RULES_TICK_MS - 1) / RULES_TICK_MS;
+}
+
+void rulesInit(RuleEngine &e, uint32_t nowMs)
+{
+  memset(e.config, 0, sizeof(e.config));
+  memset(e.power, 0, sizeof(e.power));
+  memset(e.tuning, 0, sizeof(e.tuning));
+  memset(e.actions, 0, sizeof(e.actions));
+  e.tick = 0;
+  e.tickMs = nowMs;
+  timerWheelInit(e.wheel, 0);
+}
+
+// The idle period (re)starts with every change while the channel is idle.
+static void armIdle(RuleEngine &e, uint8_t ch)
+{
+  uint16_t seconds = e.config[ch].value[RULE_IDLE_OFF];
+  if (seconds > 0 && e.power[ch] && !e.tuning[ch])
+    timerArm(e.wheel, timerId(ch, RULE_IDLE_OFF), deadlineAfter(e, seconds));
+  else
+    timerCancel(e.wheel, timerId(ch, RULE_IDLE_OFF));
+}
+
+// Only the start of a tuning cycle arms the timeout; it fires once per cycle.
+static void armTuneTimeout(RuleEngine &e, uint8_t ch)
+{
+  uint16_t seconds = e.config[ch].value[RULE_TUNE_TIMEOUT];
+  if (seconds > 0 && e.tuning[ch])
+    timerArm(e.wheel, timerId(ch, RULE_TUNE_TIMEOUT), deadlineAfter(e, seconds));
+  else
+    timerCancel(e.wheel, timerId(ch, RULE_TUNE_TIMEOUT));
+}
+
+void rulesConfigure(RuleEngine &e, uint8_t channel, RuleKind rule, uint16_t value, uint32_t nowMs)
+{
+  if (channel >= MAX_CHANNELS || rule >= RULE_COUNT)
+    return;
+  updateTick(e, nowMs);
+  e.config[channel].value[rule] = rule == RULE_NO_RESET_TUNING ? (value ? 1 : 0) : value;
+  if (rule == RULE_IDLE_OFF)
+    armIdle(e, channel);
+  else if (rule == RULE_TUNE_TIMEOUT)
+    armTuneTimeout(e, channel);
+}
+
+void rulesObserve(RuleEngine &e, uint8_t channel, bool power, bool tuning, uint32_t nowMs)
+{
+  if (power == e.power[channel] && tuning == e.tuning[channel])
+    return;
+  updateTick(e, nowMs);
+  bool tuningChanged = tuning != e.tuning[channel];
+  e.power[channel] = power;
+  e.tuning[channel] = tuning;
+  armIdle(e, channel);
+  if (tuningChanged)
+    armTuneTimeout(e, channel);
+}
+
+uint8_t rulesAdvance(RuleEngine &e, uint32_t nowMs, RuleAction *out, uint8_t maxOut)
+{
+  updateTick(e, nowMs);
+  uint8_t expired[TIMER_WHEEL_MAX];
+  uint8_t n = timerWheelAdvance(e.wheel, e.tick, expired, maxOut < TIMER_WHEEL_MAX ? maxOut : TIMER_WHEEL_MAX);
+  for (uint8_t i = 0; i < n; ++i)
+  {
+    out[i].channel = expired[i] / RULE_COUNT;
+    out[i].rule = (RuleKind)(expired[i] % RULE_COUNT);
+    e.actions[out[i].rule]++;
+  }
+  return n;
+}
+
+bool rulesAllowReset(RuleEngine &e, uint8_t channel)
+{
+  if (!e.config[channel].value[RULE_NO_RESET_TUNING] || !e.tuning[channel])
+    return true;
+  e.actions[RULE_NO_RESET_TUNING]++;
+  return false;
+}
+
+uint32_t rulesNextDueMs(const RuleEngine &e, uint32_t nowMs)
+{
+  uint32_t deadline;
+  if (!timerWheelNextDeadline(e.wheel, deadline))
+    return UINT32_MAX;
+  uint32_t dueMs = e.tickMs + (deadline - e.tick) * RULES_TICK_MS;
+  int32_t left = (int32_t)(dueMs - nowMs);
+  return left > 0 ? (uint32_t)left : 0;
+}
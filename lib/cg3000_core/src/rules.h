@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "channel.h"
+#include "timerwheel.h"
+
+// Safety rules evaluated on the device, per channel, so they act without a
+// broker round trip and keep working while MQTT is down:
+//   idle_off         power relay off after the channel was idle (power on,
+//                    not tuning) for the given seconds
+//   tune_timeout     reset pulse when the tuning line stays active for longer
+//                    than the given seconds
+//   no_reset_tuning  reset commands are refused while the channel is tuning
+// A value of 0 disables a rule. The timed rules are timers on a hashed wheel
+// with RULES_TICK_MS resolution, armed and cancelled on power and tuning
+// edges; a tick never looks at more than one wheel slot.
+enum RuleKind : uint8_t
+{
+  RULE_IDLE_OFF,
+  RULE_TUNE_TIMEOUT,
+  RULE_NO_RESET_TUNING,
+  RULE_COUNT
+};
+
+extern const char *const RULE_NAME[RULE_COUNT];
+
+const uint32_t RULES_TICK_MS = 100;
+static_assert(MAX_CHANNELS * RULE_COUNT <= TIMER_WHEEL_MAX, "one timer per channel and rule");
+
+struct RuleConfig
+{
+  uint16_t value[RULE_COUNT]; // seconds for the timed rules, 0/1 for no_reset_tuning
+};
+
+// What a timed rule asks the control loop to do.
+struct RuleAction
+{
+  uint8_t channel;
+  RuleKind rule; // RULE_IDLE_OFF: power off, RULE_TUNE_TIMEOUT: reset pulse
+};
+
+struct RuleEngine
+{
+  RuleConfig config[MAX_CHANNELS];
+  bool power[MAX_CHANNELS]; // last observed state
+  bool tuning[MAX_CHANNELS];
+  TimerWheel wheel;
+  uint32_t tick;   // RULES_TICK_MS ticks since rulesInit
+  uint32_t tickMs; // millis() of the current tick
+  uint32_t actions[RULE_COUNT]; // actions taken (no_reset_tuning: commands refused)
+};
+
+void rulesInit(RuleEngine &e, uint32_t nowMs);
+
+// Sets one rule and re-arms its timer for the channel's current state.
+void rulesConfigure(RuleEngine &e, uint8_t channel, RuleKind rule, uint16_t value, uint32_t nowMs);
+
+// Feeds the channel's current power and tuning state; timers are armed or
+// cancelled on every change.
+void rulesObserve(RuleEngine &e, uint8_t channel, bool power, bool tuning, uint32_t nowMs);
+
+// Advances the wheel to nowMs and returns the actions that became due.
+uint8_t rulesAdvance(RuleEngine &e, uint32_t nowMs, RuleAction *out, uint8_t maxOut);
+
+// False (and counted) if no_reset_tuning refuses a reset on the channel.
+bool rulesAllowReset(RuleEngine &e, uint8_t channel);
+
+// ms until the next timed rule is due, UINT32_MAX if none is armed.
+uint32_t rulesNextDueMs(const RuleEngine &e, uint32_t nowMs);
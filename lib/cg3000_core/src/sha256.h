@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental SHA-256 (FIPS 180-4), used to check firmware images while they
+// are received.
+const size_t SHA256_SIZE = 32;
+
+struct Sha256
+{
+  uint32_t h[8];
+  uint8_t block[64];
+  uint8_t fill;   // bytes in block
+  uint64_t total; // bytes hashed
+};
+
+void sha256Init(Sha256 &s);
+void sha256Update(Sha256 &s, const void *data, size_t len);
+void sha256Final(Sha256 &s, uint8_t digest[SHA256_SIZE]);
+
+// Parses 64 hex digits (either case); false on anything else.
+bool sha256FromHex(const char *hex, uint8_t digest[SHA256_SIZE]);
+void sha256ToHex(const uint8_t digest[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1]);
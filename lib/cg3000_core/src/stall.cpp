@@ -0,0 +1,130 @@
+#include "stall.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "journal.h" // crc32
+
+const char *const STALL_KIND_NAME[STALL_KIND_COUNT] = {"stall", "hang", "crash", "reset"};
+
+// Changes with the StallRecord layout, so records of another firmware are dropped.
+static const uint32_t STALL_LOG_MAGIC = 0x53544C01 + sizeof(StallRecord);
+
+static uint32_t recordCrc(const StallRecord &rec)
+{
+  return crc32(&rec, offsetof(StallRecord, crc));
+}
+
+void stallRecordSeal(StallRecord &rec)
+{
+  rec.crc = recordCrc(rec);
+}
+
+bool stallRecordValid(const StallRecord &rec)
+{
+  return rec.seq != 0 && rec.crc == recordCrc(rec);
+}
+
+void stallLogBoot(StallLog &log)
+{
+  if (log.magic != STALL_LOG_MAGIC || log.next == 0)
+  {
+    memset(&log, 0, sizeof(log));
+    log.magic = STALL_LOG_MAGIC;
+    log.next = 1;
+  }
+  for (StallRecord &rec : log.records)
+  {
+    if (rec.seq != 0 && !stallRecordValid(rec))
+      memset(&rec, 0, sizeof(rec));
+  }
+  if (log.published >= log.next)
+    log.published = log.next - 1;
+  log.boots++;
+}
+
+StallRecord &stallLogAdd(StallLog &log, const StallRecord &rec)
+{
+  StallRecord &slot = log.records[log.next % STALL_RECORDS];
+  memcpy(&slot, &rec, sizeof(slot)); // with the padding, which the CRC covers
+  slot.seq = log.next++;
+  slot.boot = log.boots;
+  stallRecordSeal(slot);
+  return slot;
+}
+
+bool stallLogNext(const StallLog &log, uint32_t after, StallRecord &out)
+{
+  bool found = false;
+  for (const StallRecord &rec : log.records)
+  {
+    if (rec.seq > after && (!found || rec.seq < out.seq))
+    {
+      memcpy(&out, &rec, sizeof(out));
+      found = true;
+    }
+  }
+  return found;
+}
+
+StallRecord *stallLogFind(StallLog &log, uint32_t seq)
+{
+  StallRecord &rec = log.records[seq % STALL_RECORDS];
+  return seq != 0 && rec.seq == seq ? &rec : nullptr;
+}
+
+void stallCopyName(char *dst, const char *src)
+{
+  size_t i = 0;
+  for (; src && src[i] && i < STALL_NAME_MAX - 1; ++i)
+    dst[i] = src[i];
+  dst[i] = '\0';
+}
+
+int formatStallRecord(const StallRecord &rec, char *buf, size_t len)
+{
+  int w = snprintf(buf, len,
+                   "{\"seq\":%lu,\"boot\":%lu,\"kind\":\"%s\",\"stage\":\"%s\",\"task\":\"%s\",\"reason\":\"%s\","
+                   "\"uptimeMs\":%lu,\"durationMs\":%lu,\"heapFree\":%lu,\"heapMin\":%lu,\"heapLargest\":%lu,"
+                   "\"stackFree\":%lu,\"backtrace\":[",
+                   (unsigned long)rec.seq, (unsigned long)rec.boot,
+                   rec.kind < STALL_KIND_COUNT ? STALL_KIND_NAME[rec.kind] : "unknown", rec.stage, rec.task,
+                   rec.reason, (unsigned long)rec.uptimeMs, (unsigned long)rec.durationMs,
+                   (unsigned long)rec.heapFree, (unsigned long)rec.heapMin, (unsigned long)rec.heapLargest,
+                   (unsigned long)rec.stackFree);
+  if (w < 0 || (size_t)w >= len)
+    return 0;
+  size_t n = w;
+  for (uint8_t i = 0; i < rec.frames && i < STALL_BACKTRACE; ++i)
+  {
+    w = snprintf(buf + n, len - n, "%s\"0x%08lx\"", i ? "," : "", (unsigned long)rec.backtrace[i]);
+    if (w < 0 || (size_t)w >= len - n)
+      return 0;
+    n += w;
+  }
+  w = snprintf(buf + n, len - n, "]}");
+  if (w < 0 || (size_t)w >= len - n)
+    return 0;
+  return n + w;
+}
+
+StallCheck stallCheck(StallWatch &w, uint32_t nowUs, const uint32_t *budgetMs, uint8_t &stage, uint32_t &elapsedMs)
+{
+  uint32_t state = w.state.load(std::memory_order_acquire);
+  uint32_t startUs = w.startUs.load(std::memory_order_relaxed);
+  if (w.state.load(std::memory_order_acquire) != state)
+    state = 0; // moved on while we looked: not stuck
+  stage = state & 0xFF;
+  elapsedMs = (nowUs - startUs) / 1000;
+  if (w.reportedState != 0)
+  {
+    if (state == w.reportedState)
+      return STALL_CHECK_ONGOING;
+    w.reportedState = 0;
+    return STALL_CHECK_ENDED;
+  }
+  if (state == 0 || stage == STALL_IDLE || elapsedMs <= budgetMs[stage])
+    return STALL_CHECK_OK;
+  w.reportedState = state;
+  return STALL_CHECK_NEW;
+}
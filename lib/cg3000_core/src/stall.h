@@ -0,0 +1,120 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Stall and crash records that survive a reset. Every watched task marks
+// the stage it is in (stallEnter/stallExit, two stores); a periodic check
+// on another task records a stage that stays past its budget, and the
+// panic handler records crashes. The records live in a StallLog the
+// platform places in memory that is kept across resets (RTC slow memory on
+// the ESP32), so they can be reported after the reboot.
+const uint8_t STALL_RECORDS = 8;
+const uint8_t STALL_BACKTRACE = 12;
+const size_t STALL_NAME_MAX = 16;
+const uint8_t STALL_IDLE = 0xFF; // no stage running
+
+enum StallKind : uint8_t
+{
+  STALL_SLOW,  // a stage ran past its budget (duration grows until it ends)
+  STALL_HANG,  // a stage did not end, the watchdog restarted the device
+  STALL_CRASH, // panic (exception, abort, watchdog interrupt) with backtrace
+  STALL_RESET, // abnormal reset without a crash record (brownout, ...)
+  STALL_KIND_COUNT
+};
+
+extern const char *const STALL_KIND_NAME[STALL_KIND_COUNT];
+
+struct StallRecord
+{
+  uint32_t seq; // 0 = empty
+  uint32_t boot; // StallLog::boots when it happened
+  StallKind kind;
+  uint8_t frames; // valid backtrace entries
+  char stage[STALL_NAME_MAX];
+  char task[STALL_NAME_MAX];
+  char reason[STALL_NAME_MAX]; // reset reason for the reset it ended in, "" if none
+  uint32_t uptimeMs;  // when it was detected
+  uint32_t durationMs;
+  uint32_t heapFree;
+  uint32_t heapMin;
+  uint32_t heapLargest; // 0 if not taken (crash)
+  uint32_t stackFree;   // bytes the task's stack never used
+  uint32_t backtrace[STALL_BACKTRACE]; // program counters, innermost first
+  uint32_t crc;
+};
+
+struct StallLog
+{
+  uint32_t magic;
+  uint32_t boots;     // since the memory was last cleared (power loss)
+  uint32_t next;      // seq of the next record
+  uint32_t published; // records up to this seq were reported
+  uint32_t crashSeq;  // crash record waiting for the reset reason, 0 = none
+  StallRecord records[STALL_RECORDS];
+};
+
+// Validates the log after a reset (clears it if the memory holds garbage,
+// drops torn records) and counts the boot.
+void stallLogBoot(StallLog &log);
+
+// Stores rec as the next record (the oldest is overwritten) and returns it.
+StallRecord &stallLogAdd(StallLog &log, const StallRecord &rec);
+
+// Recomputes the CRC after a record was changed in place.
+void stallRecordSeal(StallRecord &rec);
+bool stallRecordValid(const StallRecord &rec);
+
+// Copies the record with the lowest seq above after; false if none. The
+// caller checks the copy with stallRecordValid (it may have been torn).
+bool stallLogNext(const StallLog &log, uint32_t after, StallRecord &out);
+
+// The record with this seq if it was not overwritten yet.
+StallRecord *stallLogFind(StallLog &log, uint32_t seq);
+
+void stallCopyName(char *dst, const char *src);
+
+// {"seq":..,"kind":"stall","stage":"mqtt",...,"backtrace":["0x400d1234",...]};
+// returns the length, 0 if it does not fit into len.
+int formatStallRecord(const StallRecord &rec, char *buf, size_t len);
+
+// Stage marker of one watched task. Only that task calls stallEnter and
+// stallExit; the check reads state, startUs and state again and skips the
+// round if they changed in between.
+struct StallWatch
+{
+  std::atomic<uint32_t> state{STALL_IDLE}; // entry count << 8 | stage
+  std::atomic<uint32_t> startUs{0};
+  void *task = nullptr; // platform handle of the watched task
+  // check side
+  uint32_t reportedState = 0;
+  std::atomic<uint32_t> recordSeq{0}; // record of the current stall, 0 = none
+};
+
+inline void stallEnter(StallWatch &w, uint8_t stage, uint32_t nowUs, void *task)
+{
+  uint32_t entries = (w.state.load(std::memory_order_relaxed) >> 8) + 1;
+  w.task = task;
+  w.startUs.store(nowUs, std::memory_order_relaxed);
+  w.state.store(entries << 8 | stage, std::memory_order_release);
+}
+
+inline void stallExit(StallWatch &w)
+{
+  uint32_t state = w.state.load(std::memory_order_relaxed);
+  w.state.store((state & ~0xFFu) | STALL_IDLE, std::memory_order_release);
+}
+
+// What the check found for one watch.
+enum StallCheck : uint8_t
+{
+  STALL_CHECK_OK,      // idle or within budget
+  STALL_CHECK_NEW,     // just went past the budget (record it)
+  STALL_CHECK_ONGOING, // still stuck in the recorded stall
+  STALL_CHECK_ENDED,   // the recorded stall ended
+};
+
+// budgetMs is indexed by stage. stage and elapsedMs describe the stall
+// (NEW, ONGOING); on ENDED the caller closes the record it opened.
+StallCheck stallCheck(StallWatch &w, uint32_t nowUs, const uint32_t *budgetMs, uint8_t &stage, uint32_t &elapsedMs);
@@ -0,0 +1,53 @@
+#include "status.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "timefmt.h"
+
+bool sameStatus(const StatusSnapshot &a, const StatusSnapshot &b)
+{
+  if (a.channels != b.channels || a.timeValid != b.timeValid || a.mqttConnected != b.mqttConnected ||
+      a.now != b.now || a.uptimeSec != b.uptimeSec || strcmp(a.timeStr, b.timeStr) != 0)
+    return false;
+  for (uint8_t ch = 0; ch < a.channels; ++ch)
+  {
+    // lastResetStr follows lastReset and timeValid, which are compared already
+    if (a.power[ch] != b.power[ch] || a.tuning[ch] != b.tuning[ch] || a.lastReset[ch] != b.lastReset[ch] ||
+        a.tune[ch].count != b.tune[ch].count || memcmp(&a.rules[ch], &b.rules[ch], sizeof(RuleConfig)) != 0)
+      return false;
+  }
+  return true;
+}
+
+void statusUpdateTime(StatusSnapshot &st, time_t now, uint32_t uptimeMs, const time_t *lastReset)
+{
+  uint32_t uptimeSec = uptimeMs / 1000UL;
+  bool timeValid = now >= TIME_VALID_AFTER;
+  if (timeValid != st.timeValid || now != st.now || uptimeSec != st.uptimeSec || st.timeStr[0] == '\0')
+  {
+    if (timeValid)
+    {
+      formatTime(now, st.timeStr, sizeof(st.timeStr));
+    }
+    else
+    {
+      int n = snprintf(st.timeStr, sizeof(st.timeStr), "Since Restart: ");
+      formatUptime(uptimeMs, st.timeStr + n, sizeof(st.timeStr) - n);
+    }
+  }
+  for (uint8_t ch = 0; ch < st.channels; ++ch)
+  {
+    if (timeValid != st.timeValid || lastReset[ch] != st.lastReset[ch] || st.lastResetStr[ch][0] == '\0')
+    {
+      if (timeValid)
+        formatTime(lastReset[ch], st.lastResetStr[ch], sizeof(st.lastResetStr[ch]));
+      else
+        snprintf(st.lastResetStr[ch], sizeof(st.lastResetStr[ch]), "-");
+    }
+    st.lastReset[ch] = lastReset[ch];
+  }
+  st.timeValid = timeValid;
+  st.now = now;
+  st.uptimeSec = uptimeSec;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include "channel.h"
+#include "history.h"
+#include "rules.h"
+
+// One snapshot of everything /status, /events and MQTT report. It is rebuilt
+// into fixed buffers; readers take a copy. generation changes whenever any
+// field changes, so consumers can skip work. Channel state is laid out as
+// arrays indexed by channel; only the first `channels` entries are used.
+struct StatusSnapshot
+{
+  uint32_t generation;
+  bool timeValid;
+  bool mqttConnected;
+  time_t now;
+  uint32_t uptimeSec;
+  char timeStr[48];
+  uint8_t channels;
+  bool power[MAX_CHANNELS];
+  bool tuning[MAX_CHANNELS];
+  time_t lastReset[MAX_CHANNELS];
+  char lastResetStr[MAX_CHANNELS][24];
+  TuneStats tune[MAX_CHANNELS];
+  RuleConfig rules[MAX_CHANNELS];
+};
+
+bool sameStatus(const StatusSnapshot &a, const StatusSnapshot &b);
+
+// Fills the time fields (lastReset: one entry per channel); strings are only
+// formatted when the second or an input changed.
+void statusUpdateTime(StatusSnapshot &st, time_t now, uint32_t uptimeMs, const time_t *lastReset);
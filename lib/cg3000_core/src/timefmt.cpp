@@ -0,0 +1,43 @@
+#include "timefmt.h"
+
+#include <stdio.h>
+
+void formatTime(time_t t, char *buf, size_t len)
+{
+  if (t <= 0)
+  {
+    snprintf(buf, len, "-");
+    return;
+  }
+  struct tm tmInfo;
+  localtime_r(&t, &tmInfo);
+  strftime(buf, len, "%H:%M:%S %d.%m.%Y", &tmInfo);
+}
+
+void formatUptime(unsigned long ms, char *buf, size_t len)
+{
+  unsigned long sec = ms / 1000UL;
+  unsigned long days = sec / 86400UL;
+  sec %= 86400UL;
+  unsigned long hrs = sec / 3600UL;
+  sec %= 3600UL;
+  unsigned long mins = sec / 60UL;
+  sec %= 60UL;
+
+  if (days > 0)
+  {
+    snprintf(buf, len, "%lu d %lu h %lu m %lu s", days, hrs, mins, sec);
+  }
+  else if (hrs > 0)
+  {
+    snprintf(buf, len, "%lu h %lu m %lu s", hrs, mins, sec);
+  }
+  else if (mins > 0)
+  {
+    snprintf(buf, len, "%lu m %lu s", mins, sec);
+  }
+  else
+  {
+    snprintf(buf, len, "%lu s", sec);
+  }
+}
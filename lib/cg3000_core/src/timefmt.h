@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+#include <time.h>
+
+const time_t TIME_VALID_AFTER = 1577836800; // 2020-01-01, anything earlier means no NTP yet
+
+// "HH:MM:SS DD.MM.YYYY" in local time, "-" for t <= 0.
+void formatTime(time_t t, char *buf, size_t len);
+
+// "1 d 2 h 3 m 4 s", leading zero units are left out.
+void formatUptime(unsigned long ms, char *buf, size_t len);
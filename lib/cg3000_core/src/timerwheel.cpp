@@ -0,0 +1,113 @@
+#include "timerwheel.h"
+
+#include <string.h>
+
+static_assert(TIMER_WHEEL_MAX < TIMER_NONE, "timer ids must fit below TIMER_NONE");
+
+void timerWheelInit(TimerWheel &w, uint32_t tick)
+{
+  memset(&w, 0, sizeof(w));
+  memset(w.head, TIMER_NONE, sizeof(w.head));
+  w.tick = tick;
+}
+
+static void unlink(TimerWheel &w, uint8_t id)
+{
+  uint8_t slot = w.deadline[id] & (TIMER_WHEEL_SLOTS - 1);
+  if (w.prev[id] == TIMER_NONE)
+    w.head[slot] = w.next[id];
+  else
+    w.next[w.prev[id]] = w.next[id];
+  if (w.next[id] != TIMER_NONE)
+    w.prev[w.next[id]] = w.prev[id];
+  w.armed[id] = false;
+  w.armedCount--;
+}
+
+void timerArm(TimerWheel &w, uint8_t id, uint32_t deadline)
+{
+  if (id >= TIMER_WHEEL_MAX)
+    return;
+  if (w.armed[id])
+    unlink(w, id);
+  if ((int32_t)(deadline - w.tick) <= 0)
+    deadline = w.tick + 1;
+  uint8_t slot = deadline & (TIMER_WHEEL_SLOTS - 1);
+  w.deadline[id] = deadline;
+  w.prev[id] = TIMER_NONE;
+  w.next[id] = w.head[slot];
+  if (w.head[slot] != TIMER_NONE)
+    w.prev[w.head[slot]] = id;
+  w.head[slot] = id;
+  w.armed[id] = true;
+  w.armedCount++;
+}
+
+void timerCancel(TimerWheel &w, uint8_t id)
+{
+  if (id < TIMER_WHEEL_MAX && w.armed[id])
+    unlink(w, id);
+}
+
+// Expires the timers of one slot whose deadline is not after tick.
+static uint8_t expireSlot(TimerWheel &w, uint8_t slot, uint32_t tick, uint8_t *expired, uint8_t room)
+{
+  uint8_t n = 0;
+  uint8_t id = w.head[slot];
+  while (id != TIMER_NONE && n < room)
+  {
+    uint8_t next = w.next[id];
+    if ((int32_t)(w.deadline[id] - tick) <= 0)
+    {
+      unlink(w, id);
+      expired[n++] = id;
+    }
+    id = next;
+  }
+  return n;
+}
+
+uint8_t timerWheelAdvance(TimerWheel &w, uint32_t tick, uint8_t *expired, uint8_t maxExpired)
+{
+  uint32_t steps = tick - w.tick;
+  if ((int32_t)steps <= 0)
+    return 0;
+  uint8_t n = 0;
+  if (steps > TIMER_WHEEL_SLOTS)
+  {
+    for (uint16_t slot = 0; slot < TIMER_WHEEL_SLOTS && w.armedCount > 0; ++slot)
+    {
+      n += expireSlot(w, slot, tick, expired + n, maxExpired - n);
+      if (n == maxExpired)
+        return n; // w.tick stays, the next call makes another full pass
+    }
+  }
+  else
+  {
+    for (uint32_t t = w.tick + 1; t != tick + 1 && w.armedCount > 0; ++t)
+    {
+      n += expireSlot(w, t & (TIMER_WHEEL_SLOTS - 1), t, expired + n, maxExpired - n);
+      if (n == maxExpired)
+      {
+        w.tick = t - 1; // tick t may hold more expired timers
+        return n;
+      }
+    }
+  }
+  w.tick = tick;
+  return n;
+}
+
+bool timerWheelNextDeadline(const TimerWheel &w, uint32_t &deadline)
+{
+  bool found = false;
+  for (uint8_t id = 0; id < TIMER_WHEEL_MAX && w.armedCount > 0; ++id)
+  {
+    if (w.armed[id] && (!found || (int32_t)(w.deadline[id] - deadline) < 0))
+    {
+      deadline = w.deadline[id];
+      found = true;
+    }
+  }
+  return found;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+
+// Hashed timer wheel for a fixed set of timers identified by small ids. A
+// timer sits in the list of slot (deadline % TIMER_WHEEL_SLOTS); advancing
+// by one tick only visits that one slot, so the cost of a tick does not
+// depend on how many timers are armed. Timers further out than one
+// revolution stay in their slot until their deadline tick comes round.
+const uint16_t TIMER_WHEEL_SLOTS = 64; // power of two
+const uint16_t TIMER_WHEEL_MAX = 32;   // timer ids 0..TIMER_WHEEL_MAX-1
+const uint8_t TIMER_NONE = 0xFF;
+
+struct TimerWheel
+{
+  uint32_t tick; // last tick processed
+  uint8_t head[TIMER_WHEEL_SLOTS];
+  uint8_t next[TIMER_WHEEL_MAX];
+  uint8_t prev[TIMER_WHEEL_MAX];
+  uint32_t deadline[TIMER_WHEEL_MAX];
+  bool armed[TIMER_WHEEL_MAX];
+  uint8_t armedCount;
+};
+
+void timerWheelInit(TimerWheel &w, uint32_t tick);
+
+// (Re)arms id for deadline (a tick after w.tick, moved there if not).
+void timerArm(TimerWheel &w, uint8_t id, uint32_t deadline);
+void timerCancel(TimerWheel &w, uint8_t id);
+
+// Processes the ticks up to and including tick and writes the expired ids
+// (disarmed) to expired; returns how many. A gap of more than one revolution
+// is handled as a single pass over all slots. Timers that do not fit in
+// expired stay armed and expire on the next call.
+uint8_t timerWheelAdvance(TimerWheel &w, uint32_t tick, uint8_t *expired, uint8_t maxExpired);
+
+// Earliest deadline of all armed timers, or false if none is armed. Looks at
+// every armed timer; meant for computing a sleep timeout, not for every tick.
+bool timerWheelNextDeadline(const TimerWheel &w, uint32_t &deadline);
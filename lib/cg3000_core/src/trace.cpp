@@ -0,0 +1,263 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+const char *const TRACE_SOURCE_NAME[] = {"mqtt", "http"};
+const char *const TRACE_RESULT_NAME[TRACE_RESULT_COUNT] = {"pending", "ok",      "unchanged", "refused",
+                                                           "busy",    "invalid", "queue_full"};
+
+void traceInit(TraceTable &t)
+{
+  memset(&t, 0, sizeof(t));
+}
+
+bool traceIdValid(const char *id, size_t len)
+{
+  if (len == 0 || len > TRACE_ID_MAX)
+    return false;
+  for (size_t i = 0; i < len; ++i)
+  {
+    if (id[i] <= ' ' || id[i] > '~' || id[i] == '"' || id[i] == '\\')
+      return false;
+  }
+  return true;
+}
+
+static bool isSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// One member value: a string without escapes or a bare token (number, true, ...).
+static bool scanValue(const char *&p, const char *end, const char *&value, size_t &valueLen)
+{
+  if (p < end && *p == '"')
+  {
+    value = ++p;
+    while (p < end && *p != '"')
+    {
+      if (*p == '\\' || (uint8_t)*p < 0x20)
+        return false;
+      ++p;
+    }
+    if (p == end)
+      return false;
+    valueLen = p++ - value;
+    return true;
+  }
+  value = p;
+  while (p < end && *p != ',' && *p != '}' && !isSpace(*p))
+    ++p;
+  valueLen = p - value;
+  return valueLen > 0;
+}
+
+static void skipSpace(const char *&p, const char *end)
+{
+  while (p < end && isSpace(*p))
+    ++p;
+}
+
+bool traceUnwrap(const char *payload, size_t len, const char *&value, size_t &valueLen, const char *&id,
+                 size_t &idLen)
+{
+  const char *p = payload;
+  const char *end = payload + len;
+  id = payload;
+  idLen = 0;
+  skipSpace(p, end);
+  if (p == end || *p != '{')
+  {
+    value = payload;
+    valueLen = len;
+    return true;
+  }
+  value = end;
+  valueLen = 0;
+  ++p;
+  skipSpace(p, end);
+  if (p < end && *p == '}')
+    return true;
+  while (p < end)
+  {
+    const char *key, *member;
+    size_t keyLen, memberLen;
+    if (*p != '"' || !scanValue(p, end, key, keyLen))
+      return false;
+    skipSpace(p, end);
+    if (p == end || *p++ != ':')
+      return false;
+    skipSpace(p, end);
+    if (!scanValue(p, end, member, memberLen))
+      return false;
+    if (keyLen == 2 && memcmp(key, "id", 2) == 0)
+    {
+      id = member;
+      idLen = memberLen;
+    }
+    else if (keyLen == 5 && memcmp(key, "value", 5) == 0)
+    {
+      value = member;
+      valueLen = memberLen;
+    }
+    skipSpace(p, end);
+    if (p < end && *p == ',')
+    {
+      ++p;
+      skipSpace(p, end);
+      continue;
+    }
+    if (p == end || *p != '}')
+      return false;
+    ++p;
+    skipSpace(p, end);
+    return p == end && (idLen == 0 || traceIdValid(id, idLen));
+  }
+  return false;
+}
+
+static bool inFlight(const TraceEntry &e)
+{
+  return e.result == TRACE_PENDING || e.ackDue;
+}
+
+const TraceEntry *traceFind(const TraceTable &t, const char *id, size_t idLen)
+{
+  if (!traceIdValid(id, idLen))
+    return nullptr;
+  for (const TraceEntry &e : t.entries)
+  {
+    if (e.id[0] && strncmp(e.id, id, idLen) == 0 && e.id[idLen] == '\0')
+      return &e;
+  }
+  return nullptr;
+}
+
+// A free slot, else the oldest one that is neither queued nor waiting for its ack.
+static uint8_t claimSlot(const TraceTable &t, uint32_t nowMs)
+{
+  uint8_t oldest = TRACE_NONE;
+  uint32_t oldestAge = 0;
+  for (uint8_t i = 0; i < TRACE_SLOTS; ++i)
+  {
+    const TraceEntry &e = t.entries[i];
+    if (!e.id[0])
+      return i;
+    if (!inFlight(e) && (oldest == TRACE_NONE || nowMs - e.rxMs > oldestAge))
+    {
+      oldest = i;
+      oldestAge = nowMs - e.rxMs;
+    }
+  }
+  return oldest;
+}
+
+uint8_t traceBegin(TraceTable &t, const char *id, size_t idLen, TraceSource source, const Command &cmd, bool valid,
+                   uint32_t nowMs, uint32_t nowUs, bool &duplicate)
+{
+  duplicate = false;
+  if (!traceIdValid(id, idLen))
+    return TRACE_NONE;
+  const TraceEntry *seen = traceFind(t, id, idLen);
+  uint8_t slot = seen ? (uint8_t)(seen - t.entries) : TRACE_NONE;
+  if (seen && (inFlight(*seen) || nowMs - seen->rxMs < TRACE_DEDUP_MS))
+  {
+    TraceEntry &e = t.entries[slot];
+    duplicate = true;
+    e.retries++;
+    t.duplicates++;
+    if (e.result != TRACE_PENDING)
+    {
+      e.ackDue = true;
+      e.duplicate = true;
+    }
+    return slot;
+  }
+  if (slot == TRACE_NONE)
+    slot = claimSlot(t, nowMs);
+  if (slot == TRACE_NONE)
+  {
+    t.overflow++;
+    return TRACE_NONE;
+  }
+  TraceEntry &e = t.entries[slot];
+  memset(&e, 0, sizeof(e));
+  memcpy(e.id, id, idLen);
+  e.source = source;
+  e.result = TRACE_PENDING;
+  e.valid = valid;
+  e.cmd = cmd;
+  e.cmd.trace = slot;
+  e.rxMs = nowMs;
+  e.rxUs = nowUs;
+  t.traced++;
+  return slot;
+}
+
+void traceFinish(TraceTable &t, uint8_t slot, TraceResult result, uint32_t relayUs)
+{
+  if (slot >= TRACE_SLOTS)
+    return;
+  TraceEntry &e = t.entries[slot];
+  e.result = result;
+  e.relayUs = relayUs;
+  e.ackDue = true;
+}
+
+bool traceTakeAck(TraceTable &t, TraceEntry &out, uint32_t nowUs)
+{
+  for (TraceEntry &e : t.entries)
+  {
+    if (!e.ackDue)
+      continue;
+    if (e.ackUs == 0)
+      e.ackUs = nowUs ? nowUs : 1;
+    out = e;
+    e.ackDue = false;
+    e.duplicate = false;
+    t.acks[e.result]++;
+    return true;
+  }
+  return false;
+}
+
+// Adds a snprintf result to n; false if it was truncated.
+static bool advance(int w, size_t len, size_t &n)
+{
+  if (w < 0 || (size_t)w >= len - n)
+    return false;
+  n += w;
+  return true;
+}
+
+static int formatUs(char *buf, size_t len, const char *name, uint32_t us)
+{
+  if (us == 0)
+    return snprintf(buf, len, ",\"%s\":null", name);
+  return snprintf(buf, len, ",\"%s\":%lu", name, (unsigned long)us);
+}
+
+int formatTraceAck(const TraceEntry &e, char *buf, size_t len)
+{
+  size_t n = 0;
+  if (!advance(snprintf(buf, len, "{\"id\":\"%s\",\"src\":\"%s\",\"ch\":%u,", e.id,
+                        TRACE_SOURCE_NAME[e.source], e.cmd.channel),
+               len, n))
+    return 0;
+  int w = e.valid ? snprintf(buf + n, len - n, "\"cmd\":\"%s\",", COMMAND_NAME[e.cmd.type])
+                  : snprintf(buf + n, len - n, "\"cmd\":null,");
+  if (!advance(w, len, n))
+    return 0;
+  w = snprintf(buf + n, len - n, "\"result\":\"%s\",\"duplicate\":%s,\"retries\":%u", TRACE_RESULT_NAME[e.result],
+               e.duplicate ? "true" : "false", e.retries);
+  if (!advance(w, len, n))
+    return 0;
+  if (!advance(formatUs(buf + n, len - n, "rxUs", e.rxUs), len, n) ||
+      !advance(formatUs(buf + n, len - n, "relayUs", e.relayUs), len, n) ||
+      !advance(formatUs(buf + n, len - n, "ackUs", e.ackUs), len, n))
+    return 0;
+  if (!advance(snprintf(buf + n, len - n, "}"), len, n))
+    return 0;
+  return n;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "control.h"
+
+// End-to-end tracing of commands that carry a correlation id. A controller
+// sends {"id":"<id>","value":<payload>} instead of the plain payload (or
+// passes id= to the HTTP handlers); the device answers every such command
+// with one ack holding the result and the micros() timestamps of receipt,
+// relay actuation and ack send. Ids seen within TRACE_DEDUP_MS are not
+// queued again: a retry gets the ack of the first delivery instead, so
+// retries are idempotent. Nothing here locks; the caller serializes the
+// producers and loop() with its own lock.
+const size_t TRACE_ID_MAX = 36; // a UUID fits
+const uint8_t TRACE_SLOTS = 32; // more than the command queue holds
+const uint32_t TRACE_DEDUP_MS = 60000;
+static_assert(TRACE_SLOTS > CMD_QUEUE_SIZE + 2, "every queued command and both producers' in-flight ones need a slot");
+static_assert(TRACE_SLOTS < TRACE_NONE, "trace slots must fit below TRACE_NONE");
+
+enum TraceSource : uint8_t
+{
+  TRACE_MQTT,
+  TRACE_HTTP,
+};
+
+enum TraceResult : uint8_t
+{
+  TRACE_PENDING,    // queued, not handled yet
+  TRACE_OK,         // relay switched, pulse started or rule set
+  TRACE_UNCHANGED,  // already in the requested state
+  TRACE_REFUSED,    // no_reset_tuning rule
+  TRACE_BUSY,       // reset pulse already running
+  TRACE_INVALID,    // payload not understood
+  TRACE_QUEUE_FULL, // dropped before it reached loop()
+  TRACE_RESULT_COUNT
+};
+
+extern const char *const TRACE_SOURCE_NAME[];
+extern const char *const TRACE_RESULT_NAME[TRACE_RESULT_COUNT];
+
+struct TraceEntry
+{
+  char id[TRACE_ID_MAX + 1]; // "" = free slot
+  TraceSource source;
+  TraceResult result;
+  bool valid;     // cmd was parsed (false for TRACE_INVALID)
+  Command cmd;
+  bool ackDue;    // loop() still has to send the ack
+  bool duplicate; // the ack due answers a retry
+  uint16_t retries;
+  uint32_t rxMs;    // millis() of the first delivery, for the dedup window
+  uint32_t rxUs;    // micros() timestamps, 0 = not yet
+  uint32_t relayUs;
+  uint32_t ackUs;
+};
+
+struct TraceTable
+{
+  TraceEntry entries[TRACE_SLOTS];
+  uint32_t traced;     // commands with an id
+  uint32_t duplicates; // retries answered from the table
+  uint32_t overflow;   // refused because every slot was in flight
+  uint32_t acks[TRACE_RESULT_COUNT];
+};
+
+void traceInit(TraceTable &t);
+
+// 1..TRACE_ID_MAX printable characters, no quotes, backslashes or spaces.
+bool traceIdValid(const char *id, size_t len);
+
+// Splits an id envelope into id and value; a payload that is not an object
+// is passed through as the value with an empty id. The envelope is a flat
+// object of string or bare members without escapes; false if malformed.
+bool traceUnwrap(const char *payload, size_t len, const char *&value, size_t &valueLen, const char *&id,
+                 size_t &idLen);
+
+// Starts tracing a command (valid is false if its payload was not
+// understood; cmd then only has the channel) and returns its slot,
+// TRACE_NONE if every slot is in flight. If the id was seen within
+// TRACE_DEDUP_MS, duplicate is set and the slot of the first delivery
+// returned: the command must not be queued again, and its ack is sent again
+// if it already went out. Invalid ids are not traced (TRACE_NONE).
+uint8_t traceBegin(TraceTable &t, const char *id, size_t idLen, TraceSource source, const Command &cmd, bool valid,
+                   uint32_t nowMs, uint32_t nowUs, bool &duplicate);
+
+// Records the outcome and makes the ack due; relayUs is the time the
+// command was handled (0 if it never reached the relays).
+void traceFinish(TraceTable &t, uint8_t slot, TraceResult result, uint32_t relayUs);
+
+// Copies the next due ack to out and marks it sent at nowUs; false if none.
+bool traceTakeAck(TraceTable &t, TraceEntry &out, uint32_t nowUs);
+
+const TraceEntry *traceFind(const TraceTable &t, const char *id, size_t idLen);
+
+// {"id":"..","src":"mqtt","ch":0,"cmd":"power_on","result":"ok",...}; returns
+// the length, 0 if it does not fit into len.
+int formatTraceAck(const TraceEntry &e, char *buf, size_t len);
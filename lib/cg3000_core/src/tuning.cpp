@@ -0,0 +1,25 @@
+#include "tuning.h"
+
+bool tuningSettle(TuningState &st, bool active, uint32_t edgeMs)
+{
+  if (active == st.active)
+    return false;
+  st.active = active;
+  st.lastChangeMs = edgeMs;
+  st.transitions++;
+  return true;
+}
+
+void tuningEdge(TuningEdge &edge, uint32_t nowMs)
+{
+  edge.pending = true;
+  edge.edgeMs = nowMs;
+}
+
+bool tuningPoll(TuningState &st, TuningEdge &edge, bool active, uint32_t nowMs)
+{
+  if (!edge.pending || nowMs - edge.edgeMs < TUNING_DEBOUNCE_MS)
+    return false;
+  edge.pending = false;
+  return tuningSettle(st, active, edge.edgeMs);
+}
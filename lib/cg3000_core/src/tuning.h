@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+// Tuning input (yellow wire) debouncing: a level is taken over once the raw
+// input stayed unchanged for TUNING_DEBOUNCE_MS after its last edge.
+const uint32_t TUNING_DEBOUNCE_MS = 15;
+
+struct TuningState
+{
+  bool active;           // debounced level, true = tuning line pulled LOW
+  uint32_t lastChangeMs; // millis() of the last debounced transition
+  uint32_t transitions;  // debounced transitions since boot
+};
+
+// Applies the settled level; returns true on a debounced transition.
+bool tuningSettle(TuningState &st, bool active, uint32_t edgeMs);
+
+// Polling variant of the ISR + one-shot timer, for drivers that see every raw
+// edge and advance time themselves (native replay).
+struct TuningEdge
+{
+  bool pending;
+  uint32_t edgeMs;
+};
+
+void tuningEdge(TuningEdge &edge, uint32_t nowMs);
+bool tuningPoll(TuningState &st, TuningEdge &edge, bool active, uint32_t nowMs);
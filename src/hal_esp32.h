@@ -0,0 +1,106 @@
+#pragma once
+// ESP32 implementation of the hardware abstraction in lib/cg3000_core.
+#include <Arduino.h>
+#include <AsyncMqttClient.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include <time.h>
+
+#include "hal.h"
+
+class EspClock : public HalClock
+{
+public:
+  uint32_t millis() override { return ::millis(); }
+  time_t now() override
+  {
+    time_t t;
+    time(&t);
+    return t;
+  }
+};
+
+class EspGpio : public HalGpio
+{
+public:
+  bool read(uint8_t pin) override { return digitalRead(pin) == HIGH; }
+  void write(uint8_t pin, bool high) override { digitalWrite(pin, high ? HIGH : LOW); }
+};
+
+class EspMqtt : public HalMqtt
+{
+public:
+  explicit EspMqtt(AsyncMqttClient &client) : _client(client) {}
+  bool connected() override { return _client.connected(); }
+  void publish(const char *topic, const char *payload, bool retain) override { _client.publish(topic, 0, retain, payload); }
+
+private:
+  AsyncMqttClient &_client;
+};
+
+// Flash region of a data partition (the state journal).
+class EspFlash : public HalFlash
+{
+public:
+  explicit EspFlash(const esp_partition_t *partition) : _partition(partition) {}
+  bool read(uint32_t offset, void *buf, size_t len) override
+  {
+    return _partition && esp_partition_read(_partition, offset, buf, len) == ESP_OK;
+  }
+  bool write(uint32_t offset, const void *buf, size_t len) override
+  {
+    return _partition && esp_partition_write(_partition, offset, buf, len) == ESP_OK;
+  }
+  bool eraseSector(uint32_t offset) override
+  {
+    return _partition && esp_partition_erase_range(_partition, offset, SPI_FLASH_SEC_SIZE) == ESP_OK;
+  }
+
+private:
+  const esp_partition_t *_partition;
+};
+
+// The OTA partition the running image did not boot from. It is erased
+// sector by sector as the image is written (instead of all at once in
+// begin), so no single call holds the flash for long; esp_ota_end checks the
+// image header, segments and appended hash before it can become the boot
+// partition.
+class EspOtaSlot : public HalOtaSlot
+{
+public:
+  bool begin() override
+  {
+    abort(); // handle left open by an upload that was cut off
+    writeUs = 0;
+    _partition = esp_ota_get_next_update_partition(nullptr);
+    return _partition && esp_ota_begin(_partition, OTA_WITH_SEQUENTIAL_WRITES, &_handle) == ESP_OK;
+  }
+  uint32_t size() override { return _partition ? _partition->size : 0; }
+  bool write(const void *data, size_t len) override
+  {
+    uint32_t startUs = micros();
+    bool ok = esp_ota_write(_handle, data, len) == ESP_OK;
+    writeUs += micros() - startUs;
+    return ok;
+  }
+  bool commit() override
+  {
+    esp_err_t err = esp_ota_end(_handle);
+    _handle = 0;
+    return err == ESP_OK && esp_ota_set_boot_partition(_partition) == ESP_OK;
+  }
+  void abort() override
+  {
+    if (_handle)
+      esp_ota_abort(_handle);
+    _handle = 0;
+  }
+
+  const esp_partition_t *partition() const { return _partition; }
+  uint32_t writeUs = 0; // time spent in flash erase and write for the current image
+
+private:
+  const esp_partition_t *_partition = nullptr;
+  esp_ota_handle_t _handle = 0;
+};
@@ -3,7 +3,40 @@
 #include <WiFiManager.h>
 #include <time.h>
 #include <AsyncMqttClient.h>
+#include <AsyncUDP.h>
 #include <ESPmDNS.h>
+#include <Preferences.h>
+#include <atomic>
+#include <esp_debug_helpers.h>
+#include <esp_heap_caps.h>
+#include <esp_pm.h>
+#include <esp_private/panic_internal.h>
+#include <esp_sleep.h>
+#include <freertos/xtensa_context.h>
+#include <errno.h>
+#include <hal/gpio_ll.h>
+#include <lwip/sockets.h>
+#include <soc/soc_memory_layout.h>
+#include <stdarg.h>
+
+#include "beacon.h"
+#include "channels.h" // compile-time channel table
+#include "control.h"
+#include "entities.h"
+#include "hal_esp32.h"
+#include "history.h"
+#include "index_html_gz.h" // generated from web/index.html by tools/embed_web.py
+#include "journal.h"
+#include "logring.h"
+#include "metrics.h"
+#include "mqtt_state.h"
+#include "ota.h"
+#include "rules.h"
+#include "stall.h"
+#include "status.h"
+#include "timefmt.h"
+#include "trace.h"
+#include "tuning.h"
 
 WebServer server(80);
 
@@ -11,26 +44,75 @@ WiFiManager wm;
 
 AsyncMqttClient mqttClient;
 
+EspClock g_clock;
+EspGpio g_gpio;
+EspMqtt g_mqtt(mqttClient);
+
+// Diagnostics go to a RAM ring (GET /log) instead of blocking on the UART.
+// The UART sink is only on in debug builds; with CG3000_LOG_MQTT warnings and
+// errors are also published to cg3000/<deviceId>/log. Both sinks are fed
+// from loop() and drop lines rather than wait.
+#ifndef CG3000_LOG_UART
+#ifdef __PLATFORMIO_BUILD_DEBUG__
+#define CG3000_LOG_UART 1
+#else
+#define CG3000_LOG_UART 0
+#endif
+#endif
+#ifndef CG3000_LOG_MQTT
+#define CG3000_LOG_MQTT 0
+#endif
+
+LogRing g_log;
+
+// Every call site gets its own rate limit (see LogSite).
+#define LOG(level, ...)                                         \
+  do                                                            \
+  {                                                             \
+    static LogSite logSite;                                     \
+    logWrite(g_log, &logSite, millis(), level, __VA_ARGS__);    \
+  } while (0)
+
 const char *MQTT_HOST = "mqtt.ham.local";
 const uint16_t MQTT_PORT = 1883;
 
 IPAddress g_mqttIp;
 bool g_mqttIpValid = false;
-unsigned long g_lastDnsAttempt = 0;
-uint32_t g_dnsBackoffMs = 5000;
+const uint32_t DNS_BACKOFF_MIN = 5000;
 const uint32_t DNS_BACKOFF_MAX = 60000;
+const uint32_t MDNS_QUERY_TIMEOUT_MS = 2000;
+
+Preferences g_prefs;
+const char *PREFS_NAMESPACE = "cg3000";
+const char *PREF_MQTT_IP = "mqttIp";
+const char *PREF_POWER = "power"; // only without a journal partition
+
+// Relay state, last reset and lifetime counters survive reboots in the
+// journal partition (see partitions.csv). Owned by loop().
+const char *JOURNAL_PARTITION = "journal";
+const esp_partition_subtype_t JOURNAL_PARTITION_SUBTYPE = (esp_partition_subtype_t)0x99;
+Journal g_journal = {};
+JournalState g_persisted = {};
+uint32_t g_tuneCyclesBase = 0; // completed tuning cycles before this boot
+
+// Firmware update (POST /update, see handleUpdate): written by the OTA task,
+// read by /status and /metrics.
+EspOtaSlot g_otaSlot;
+OtaUpdate g_ota = {};
+uint32_t g_otaVerified = 0;
+uint32_t g_otaFailed = 0;
+bool g_otaTrial = false; // loop(): this image was just installed and is not confirmed yet
+String g_otaRollback;    // why the update before this boot was rolled back, empty if it was not
+
+// Safety rules (see rules.h), owned by loop(). The configuration is kept in
+// NVS and changed through rule commands from MQTT or POST /rules.
+const char *PREF_RULES = "rules";
+RuleEngine g_rules;
 
-const char *HAM_DISCOVERY_PREFIX = "ham";
 String g_deviceId;
-unsigned long g_lastMqttStatePublish = 0;
-bool g_lastPowerPublished = false;
-bool g_lastTuningPublished = false;
-String g_lastLastResetStr;
-String g_lastTimeStr;
-bool g_mqttInitialPublishDone = false;
 const unsigned long MQTT_HEARTBEAT_MS = 5UL * 60UL * 1000UL; // 5 minutes
-const unsigned long MQTT_CHECK_INTERVAL_MS = 1000UL;         // Proofintervall in loop()
 unsigned long g_lastMqttHeartbeat = 0;
+const unsigned long MQTT_CONNECT_RETRY_MS = 2000UL;
 
 String chipId()
 {
@@ -40,604 +122,2644 @@ String chipId()
   return String(buf);
 }
 
-String deviceBaseTopic()
+MqttTopics g_mqttTopics[CHANNEL_COUNT];
+MqttPublisher g_mqttPub = {}; // only touched from loop()
+
+inline const char *topic(uint8_t channel, TopicId id)
 {
-  return "cg3000/" + g_deviceId; // z.B. cg3000/cg3000-ABCDEF
+  return g_mqttTopics[channel].topics[id];
 }
 
-bool shouldRestart = false;
-#define PIN_STATUS_TUNING 34
-#define PIN_RELAY_RESET 16
-#define PIN_RELAY_POWER 17
+// Power save: dynamic frequency scaling and automatic light sleep between
+// events (light sleep only if the SDK was built with tickless idle).
+#ifndef CG3000_POWER_SAVE
+#define CG3000_POWER_SAVE 1
+#endif
 
-time_t g_lastReset = 0;
+std::atomic<bool> shouldRestart{false}; // set by loop() or the OTA task
+
+time_t g_lastReset[MAX_CHANNELS] = {};
 unsigned long g_bootMillis = 0;
-bool g_timeValid = false;
 
-String formatTime(time_t t)
+// Boot milestones in millis() since power-on, 0 = not reached yet.
+uint32_t g_bootIpMs = 0;
+uint32_t g_bootTimeMs = 0;
+std::atomic<uint32_t> g_bootTtfbMs{0};
+
+// Runtime metrics for /metrics. Every histogram and counter has one writing
+// task (noted below), so recording is a few plain adds without locking.
+enum LoopStage : uint8_t
 {
-  if (t <= 0)
-    return String("-");
-  struct tm tmInfo;
-  localtime_r(&t, &tmInfo);
-  char buf[32];
-  strftime(buf, sizeof(buf), "%H:%M:%S %d.%m.%Y", &tmInfo);
-  return String(buf);
+  STAGE_LOOP,      // loop(): whole iteration
+  STAGE_COMMANDS,  // loop(): processCommands() and rulesLoop()
+  STAGE_STATUS,    // loop(): refreshStatus()
+  STAGE_MQTT,      // loop(): connect, discovery, state publishing and beacon
+  STAGE_HTTP,      // web task: server.handleClient()
+  STAGE_EVENTS,    // web task: eventsLoop()
+  STAGE_RESOLVE,   // resolver task: one broker lookup (mDNS, then DNS)
+  STAGE_ASYNC_TCP, // AsyncTCP task: MQTT connect and message callbacks
+  STAGE_COUNT
+};
+
+const char *const STAGE_NAME[STAGE_COUNT] = {"loop", "commands", "status", "mqtt", "http", "events", "resolve", "async_tcp"};
+
+enum HttpRoute : uint8_t
+{
+  ROUTE_ROOT,
+  ROUTE_STATUS,
+  ROUTE_EVENTS,
+  ROUTE_RESET,
+  ROUTE_POWER,
+  ROUTE_METRICS,
+  ROUTE_HISTORY,
+  ROUTE_LOG,
+  ROUTE_RULES,
+  ROUTE_ACK,
+  ROUTE_STALLS,
+  ROUTE_NOT_FOUND,
+  ROUTE_COUNT
+};
+
+const char *const ROUTE_NAME[ROUTE_COUNT] = {"/", "/status", "/events", "/reset", "/power", "/metrics", "/history", "/log", "/rules", "/ack", "/stalls", "other"};
+
+LatencyHistogram g_stageLatency[STAGE_COUNT];
+LatencyHistogram g_httpLatency[ROUTE_COUNT]; // web task
+LatencyHistogram g_mqttMessageLatency;       // AsyncTCP task (onMqttMessage)
+
+uint32_t g_mqttConnectAttempts = 0; // loop()
+uint32_t g_mqttConnects = 0;        // AsyncTCP task
+uint32_t g_mqttDisconnects = 0;     // AsyncTCP task
+uint32_t g_dnsAttempts = 0;         // resolver task
+uint32_t g_dnsFailures = 0;         // resolver task
+uint32_t g_dnsBackoffMs = 0;        // resolver task, 0 = not waiting
+
+// Records the time since startUs and returns now, so stages can be chained.
+uint32_t observeSince(LatencyHistogram &h, uint32_t startUs)
+{
+  uint32_t nowUs = micros();
+  histogramObserve(h, nowUs - startUs);
+  return nowUs;
 }
 
-time_t nowSec()
+// Stall watchdog (see stall.h): each watched task marks the stage it is in,
+// an esp_timer checks every STALL_CHECK_MS whether one ran past its budget.
+// A stage that does not end within CG3000_STALL_RESTART_MS restarts the
+// device (0 = never). Records are kept in RTC slow memory across resets.
+#ifndef CG3000_STALL_RESTART_MS
+#define CG3000_STALL_RESTART_MS 30000
+#endif
+
+const uint32_t STALL_CHECK_MS = 250;
+const uint32_t STAGE_BUDGET_MS[STAGE_COUNT] = {
+    1000,                          // loop: bootLoop() and logSinks() only
+    500,                           // commands
+    500,                           // status (journal writes included)
+    2000,                          // mqtt
+    2000,                          // http: one slow client
+    1000,                          // events
+    MDNS_QUERY_TIMEOUT_MS + 5000,  // resolve
+    500,                           // async_tcp
+};
+
+enum WatchedTask : uint8_t
 {
-  time_t now;
-  time(&now);
-  return now;
+  WATCH_LOOP,
+  WATCH_WEB,
+  WATCH_RESOLVE,
+  WATCH_ASYNC_TCP,
+  WATCH_COUNT
+};
+
+StallWatch g_watch[WATCH_COUNT];
+RTC_NOINIT_ATTR StallLog g_stallLog;
+portMUX_TYPE g_stallMux = portMUX_INITIALIZER_UNLOCKED; // not taken by the panic handler
+uint32_t g_stallCount[STAGE_COUNT]; // esp_timer task: stalls since boot
+const char *g_resetReason = "";
+
+inline void stageEnter(WatchedTask task, LoopStage stage, uint32_t nowUs)
+{
+  stallEnter(g_watch[task], stage, nowUs, xTaskGetCurrentTaskHandle());
 }
 
-bool isTimeValid()
+inline void stageExit(WatchedTask task)
 {
-  struct tm tmInfo;
-  if (!getLocalTime(&tmInfo, 10))
-    return false;
-  return (tmInfo.tm_year + 1900) >= 2020;
+  stallExit(g_watch[task]);
 }
 
-String formatUptime(unsigned long ms)
+// Return addresses hold the call window size in the top bits; adjusted the
+// way the IDF prints backtraces, so both decode alike.
+inline uint32_t stackPc(uint32_t pc)
 {
-  unsigned long sec = ms / 1000UL;
-  unsigned long days = sec / 86400UL;
-  sec %= 86400UL;
-  unsigned long hrs = sec / 3600UL;
-  sec %= 3600UL;
-  unsigned long mins = sec / 60UL;
-  sec %= 60UL;
+  if (pc & 0x80000000)
+    pc = (pc & 0x3fffffff) | 0x40000000;
+  return pc - 3; // the call instruction
+}
 
-  char buf[48];
-  if (days > 0)
+uint8_t walkBacktrace(esp_backtrace_frame_t frame, uint32_t *out)
+{
+  uint8_t n = 0;
+  out[n++] = stackPc(frame.pc);
+  while (n < STALL_BACKTRACE && frame.next_pc != 0 && esp_backtrace_get_next_frame(&frame))
   {
-    snprintf(buf, sizeof(buf), "%lu d %lu h %lu m %lu s", days, hrs, mins, sec);
+    uint32_t pc = stackPc(frame.pc);
+    if (!esp_ptr_executable((void *)pc))
+      break;
+    out[n++] = pc;
   }
-  else if (hrs > 0)
+  return n;
+}
+
+// Backtrace of a task that is not running, from the context it saved on its
+// stack when it was switched out; empty while it runs on the other core.
+uint8_t taskBacktrace(void *task, uint32_t *out)
+{
+  if (!task || eTaskGetState((TaskHandle_t)task) == eRunning)
+    return 0;
+  const void *top = *(void *const *)task; // pxTopOfStack is the TCB's first member
+  esp_backtrace_frame_t frame = {};
+  if (((const XtExcFrame *)top)->exit != 0) // preempted by an interrupt
   {
-    snprintf(buf, sizeof(buf), "%lu h %lu m %lu s", hrs, mins, sec);
+    const XtExcFrame *f = (const XtExcFrame *)top;
+    frame.pc = f->pc;
+    frame.sp = f->a1;
+    frame.next_pc = f->a0;
   }
-  else if (mins > 0)
+  else // yielded from a blocking call
   {
-    snprintf(buf, sizeof(buf), "%lu m %lu s", mins, sec);
+    const XtSolFrame *f = (const XtSolFrame *)top;
+    frame.pc = f->pc;
+    frame.sp = f->a1;
+    frame.next_pc = f->a0;
   }
-  else
+  if (!esp_stack_ptr_is_sane(frame.sp))
+    return 0;
+  return walkBacktrace(frame, out);
+}
+
+esp_timer_handle_t g_stallTimer = nullptr;
+
+// esp_timer task, every STALL_CHECK_MS: records stages past their budget,
+// keeps the duration of an open record current and restarts on a hang.
+void onStallCheck(void *)
+{
+  uint32_t nowUs = micros();
+  for (uint8_t i = 0; i < WATCH_COUNT; ++i)
   {
-    snprintf(buf, sizeof(buf), "%lu s", sec);
+    StallWatch &w = g_watch[i];
+    uint8_t stage;
+    uint32_t elapsedMs;
+    switch (stallCheck(w, nowUs, STAGE_BUDGET_MS, stage, elapsedMs))
+    {
+    case STALL_CHECK_NEW:
+    {
+      StallRecord rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.kind = STALL_SLOW;
+      stallCopyName(rec.stage, STAGE_NAME[stage]);
+      stallCopyName(rec.task, pcTaskGetTaskName((TaskHandle_t)w.task));
+      rec.uptimeMs = millis();
+      rec.durationMs = elapsedMs;
+      rec.heapFree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+      rec.heapMin = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+      rec.heapLargest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+      rec.stackFree = uxTaskGetStackHighWaterMark((TaskHandle_t)w.task);
+      rec.frames = taskBacktrace(w.task, rec.backtrace);
+      portENTER_CRITICAL(&g_stallMux);
+      w.recordSeq = stallLogAdd(g_stallLog, rec).seq;
+      portEXIT_CRITICAL(&g_stallMux);
+      g_stallCount[stage]++;
+      LOG(LOG_WARN, "Stall in %s on %s: %lu ms (record %lu)", rec.stage, rec.task, (unsigned long)elapsedMs,
+          (unsigned long)w.recordSeq.load());
+      break;
+    }
+    case STALL_CHECK_ONGOING:
+    {
+      bool hang = CG3000_STALL_RESTART_MS && elapsedMs > CG3000_STALL_RESTART_MS;
+      portENTER_CRITICAL(&g_stallMux);
+      StallRecord *rec = stallLogFind(g_stallLog, w.recordSeq);
+      if (rec)
+      {
+        rec->durationMs = elapsedMs;
+        if (hang)
+        {
+          rec->kind = STALL_HANG;
+          g_stallLog.crashSeq = rec->seq; // stallBoot() adds the reset reason
+        }
+        stallRecordSeal(*rec);
+      }
+      portEXIT_CRITICAL(&g_stallMux);
+      if (hang)
+      {
+        LOG(LOG_ERROR, "%s stuck in %s for %lu ms, restarting", pcTaskGetTaskName((TaskHandle_t)w.task),
+            STAGE_NAME[stage], (unsigned long)elapsedMs);
+        esp_restart();
+      }
+      break;
+    }
+    case STALL_CHECK_ENDED:
+      w.recordSeq = 0;
+      break;
+    case STALL_CHECK_OK:
+      break;
+    }
   }
-  return String(buf);
 }
 
-String htmlPage()
-{
-  String html = "<!DOCTYPE html><html lang='en'><head><meta charset='UTF-8'>";
-  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
-  html += "<title>CG-3000 Remote</title>";
-  html += "<style>";
-  html += ":root{--bg:#0f172a;--card:#111827;--muted:#94a3b8;--ok:#22c55e;--err:#ef4444;--text:#e5e7eb;}";
-  html += "html,body{height:100%;margin:0;padding:0;background:var(--bg);color:var(--text);font-family:system-ui,-apple-system,Segoe UI,Roboto,Helvetica,Arial,sans-serif}";
-  html += ".wrap{max-width:780px;margin:0 auto;padding:24px;}";
-  html += ".card{background:var(--card);border-radius:14px;box-shadow:0 6px 24px rgba(0,0,0,.35);padding:22px;}";
-  html += "h1{margin:0 0 8px 0;font-size:24px;font-weight:700}";
-  html += ".sub{color:var(--muted);font-size:14px;margin-bottom:18px}";
-  html += ".grid{display:grid;grid-template-columns:repeat(2,minmax(240px,1fr));gap:18px}";
-  html += ".kpi{background:#0b1220;border:1px solid #1f2937;border-radius:12px;padding:14px;position:relative}";
-  html += ".kpi .label{color:var(--muted);font-size:12px;text-transform:uppercase;letter-spacing:.08em}";
-  html += ".kpi .value{margin-top:6px;font-size:18px}";
-  html += ".muted{color:var(--muted)}";
-  html += ".badge{display:inline-block;padding:2px 10px;border-radius:999px;font-size:12px;font-weight:600}";
-  html += ".badge.on{background:rgba(34,197,94,.12);color:var(--ok);border:1px solid rgba(34,197,94,.35)}";
-  html += ".badge.off{background:rgba(239,68,68,.12);color:var(--err);border:1px solid rgba(239,68,68,.35)}";
-  /* Reset icon button inside Last Reset card (top-right) */
-  html += ".icon-btn{position:absolute;top:10px;right:10px;display:inline-flex;align-items:center;justify-content:center;width:32px;height:32px;border-radius:8px;border:1px solid #374151;background:#1f2937;color:#e5e7eb;cursor:pointer}";
-  html += ".icon-btn:hover{background:#273244}";
-  html += ".icon{width:16px;height:16px;display:inline-block}";
-  /* MQTT icon */
-  html += ".topbar{display:flex;align-items:center;justify-content:space-between;margin-bottom:8px}";
-  html += ".mqtt-ind{position:relative;display:inline-flex;align-items:center;gap:8px;}";
-  html += ".mqtt-dot{width:12px;height:12px;border-radius:50%;box-shadow:0 0 0 3px rgba(255,255,255,0.06) inset}";
-  html += ".mqtt-on{background:#22c55e}";  // grün
-  html += ".mqtt-off{background:#3b82f6}"; // blau
-  html += ".mqtt-label{font-size:12px;color:var(--muted)}";
-  /* Toggle Switch visuals (inside Power card) */
-  html += ".switch-wrap{display:flex;align-items:center;gap:10px;margin-top:6px}";
-  html += ".tgl{appearance:none;-webkit-appearance:none;width:58px;height:32px;background:#b91c1c;border-radius:999px;position:relative;outline:none;cursor:pointer;transition:background .2s ease, box-shadow .2s ease;border:1px solid rgba(0,0,0,.35)}";
-  html += ".tgl:before{content:\"\";position:absolute;top:3px;left:3px;width:26px;height:26px;background:#fff;border-radius:50%;transition:transform .2s ease, box-shadow .2s ease;box-shadow:0 1px 2px rgba(0,0,0,.35)}";
-  html += ".tgl:checked{background:#16a34a}";
-  html += ".tgl:checked:before{transform:translateX(26px)}";
-  html += ".state{min-width:42px;text-align:center;font-weight:700}";
-  html += ".state.on{color:#22c55e}.state.off{color:#ef4444}";
-  html += "@media (max-width:560px){.grid{grid-template-columns:1fr}}";
-  html += "</style>";
-  html += "<script>";
-  html += "let busy=false;";
-  html += "async function fetchStatus(){";
-  html += "  try{const r=await fetch('/status',{cache:'no-store'});const s=await r.json();";
-  html += "    const power=s.power===true;const tuning=s.tuning===true;";
-  html += "    const tuneBadge=document.getElementById('tuningBadge');";
-  html += "    tuneBadge.className='badge '+(tuning?'on':'off');";
-  html += "    tuneBadge.textContent=tuning?'TUNED':'NOT TUNED';";
-  html += "    document.getElementById('lastReset').textContent=s.lastResetStr||'-';";
-  html += "    document.getElementById('now').textContent=s.timeStr||'-';";
-  html += "    const tgl=document.getElementById('powerToggle');";
-  html += "    if(!busy){tgl.checked=power;}";
-  html += "    const stateEl=document.getElementById('powerState');";
-  html += "    stateEl.textContent=power?'ON':'OFF';";
-  html += "    stateEl.className='state ' + (power?'on':'off');";
-  html += "    const mqttDot=document.getElementById('mqttDot');";
-  html += "    if(s.mqttConnected===true){";
-  html += "      mqttDot.className='mqtt-dot mqtt-on';";
-  html += "    }else{";
-  html += "      mqttDot.className='mqtt-dot mqtt-off';";
-  html += "    }";
-  html += "  }catch(e){}";
-  html += "  setTimeout(fetchStatus,2000);";
-  html += "}";
-  html += "async function togglePower(ev){";
-  html += "  if(busy) return; busy=true;";
-  html += "  const tgl=ev.currentTarget; tgl.disabled=true;";
-  html += "  try{await fetch('/power',{method:'POST'});";
-  html += "      setTimeout(fetchStatus,300);";
-  html += "  }catch(e){}";
-  html += "  finally{tgl.disabled=false; busy=false;}";
-  html += "}";
-  html += "function doReset(){";
-  html += "  const btn=document.getElementById('btnReset'); btn.disabled=true;";
-  html += "  fetch('/reset',{method:'POST'}).then(()=>setTimeout(()=>{btn.disabled=false;},1200)).catch(()=>{btn.disabled=false;});";
-  html += "}";
-  html += "window.addEventListener('load',()=>{";
-  html += "  document.getElementById('powerToggle').addEventListener('change',togglePower);";
-  html += "  const st=document.getElementById('powerState'); st.className='state off';";
-  html += "  fetchStatus();";
-  html += "});";
-  html += "</script>";
-  html += "</head><body>";
-  html += "  <div class='wrap'>";
-  html += "    <div class='card'>";
-  html += "      <div class='topbar'>";
-  html += "        <div>";
-  html += "          <h1>CG-3000 Antenna Tuner</h1>";
-  html += "          <div class='sub'>Status and Control</div>";
-  html += "        </div>";
-  html += "        <div class='mqtt-ind' title='MQTT connection'>";
-  html += "          <span id='mqttDot' class='mqtt-dot mqtt-off'></span>";
-  html += "          <span id='mqttText' class='mqtt-label'>MQTT</span>";
-  html += "        </div>";
-  html += "      </div>";
-  html += "      <div class='grid'>";
-  // Row 1: top-left
-  html += "        <div class='kpi'>";
-  html += "          <div class='label'>Power</div>";
-  html += "          <div class='switch-wrap'>";
-  html += "            <input id='powerToggle' class='tgl' type='checkbox'/>";
-  html += "            <div id='powerState' class='state'>OFF</div>";
-  html += "          </div>";
-  html += "        </div>";
-  // Row 1: top-right
-  html += "        <div class='kpi'>";
-  html += "          <div class='label'>Time</div>";
-  html += "          <div class='value' id='now'>-</div>";
-  html += "          <div class='muted' style='font-size:12px;margin-top:4px'>(NTP time or uptime)</div>";
-  html += "        </div>";
-  // Row 2: bottom-left
-  html += "        <div class='kpi'>";
-  html += "          <div class='label'>Tuning</div>";
-  html += "          <div class='value'><span id='tuningBadge' class='badge off'>IDLE</span></div>";
-  html += "        </div>";
-  // Row 2: bottom-right
-  html += "        <div class='kpi'>";
-  html += "          <div class='label'>Last Reset</div>";
-  html += "          <button id='btnReset' class='icon-btn' onclick='doReset()' title='Trigger reset'>";
-  html += "            <span class='icon' aria-hidden='true'>";
-  html += "              <svg viewBox='0 0 24 24' fill='none' stroke='currentColor' stroke-width='2' stroke-linecap='round' stroke-linejoin='round' width='16' height='16'>";
-  html += "                <polyline points='23 4 23 10 17 10'></polyline>";
-  html += "                <path d='M20.49 15a9 9 0 1 1 2.13-9'></path>";
-  html += "              </svg>";
-  html += "            </span>";
-  html += "          </button>";
-  html += "          <div class='value' id='lastReset'>-</div>";
-  html += "        </div>";
-  // end grid
-  html += "      </div>";
-  html += "    </div>";
-  html += "  </div>";
-  html += "</body></html>";
-  return html;
-}
-
-bool readTuning(uint16_t stableMs = 15) {
-  bool first = digitalRead(PIN_STATUS_TUNING) == LOW;
-  unsigned long start = millis();
-  while (millis() - start < stableMs) {
-    if ((digitalRead(PIN_STATUS_TUNING) == LOW) != first) {
-      first = digitalRead(PIN_STATUS_TUNING) == LOW;
-      start = millis();
+extern "C" void __real_esp_panic_handler(panic_info_t *info);
+
+// Linked in place of esp_panic_handler (-Wl,--wrap, see platformio.ini):
+// records the crash before the panic handler prints it and resets. Runs
+// with the other core halted, so it takes no locks and does not format.
+extern "C" void __wrap_esp_panic_handler(panic_info_t *info)
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandleForCPU(info->core);
+  StallRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.kind = STALL_CRASH;
+  for (const StallWatch &w : g_watch)
+  {
+    uint32_t state = w.state.load(std::memory_order_relaxed);
+    if (w.task == task && (state & 0xFF) != STALL_IDLE)
+    {
+      stallCopyName(rec.stage, STAGE_NAME[state & 0xFF]);
+      rec.durationMs = (micros() - w.startUs.load(std::memory_order_relaxed)) / 1000;
     }
   }
-  return first;
+  stallCopyName(rec.task, task ? pcTaskGetTaskName(task) : "isr");
+  rec.uptimeMs = millis();
+  rec.heapFree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  rec.heapMin = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  if (task)
+    rec.stackFree = uxTaskGetStackHighWaterMark(task);
+  const XtExcFrame *f = (const XtExcFrame *)info->frame;
+  if (f && esp_stack_ptr_is_sane(f->a1))
+  {
+    esp_backtrace_frame_t frame = {};
+    frame.pc = f->pc;
+    frame.sp = f->a1;
+    frame.next_pc = f->a0;
+    rec.frames = walkBacktrace(frame, rec.backtrace);
+  }
+  g_stallLog.crashSeq = stallLogAdd(g_stallLog, rec).seq;
+  __real_esp_panic_handler(info);
 }
 
-bool readPower() {
-  return (digitalRead(PIN_RELAY_POWER) == HIGH);
+const char *resetReasonName(esp_reset_reason_t reason)
+{
+  switch (reason)
+  {
+  case ESP_RST_POWERON:
+    return "power_on";
+  case ESP_RST_EXT:
+    return "external";
+  case ESP_RST_SW:
+    return "software";
+  case ESP_RST_PANIC:
+    return "panic";
+  case ESP_RST_INT_WDT:
+    return "int_wdt";
+  case ESP_RST_TASK_WDT:
+    return "task_wdt";
+  case ESP_RST_WDT:
+    return "wdt";
+  case ESP_RST_DEEPSLEEP:
+    return "deep_sleep";
+  case ESP_RST_BROWNOUT:
+    return "brownout";
+  default:
+    return "unknown";
+  }
 }
 
-bool resolveMqttHostNonBlocking()
+// Early in setup(): checks the records kept across the reset, gives the
+// crash or hang that caused it its reset reason (or records an abnormal
+// reset nothing caught) and starts the check timer.
+void stallBoot()
 {
-  unsigned long nowMs = millis();
-  if (g_mqttIpValid)
-    return true;
-  if (nowMs - g_lastDnsAttempt < g_dnsBackoffMs)
-    return false;
-
-  g_lastDnsAttempt = nowMs;
-
-  IPAddress mdnsIp = MDNS.queryHost(MQTT_HOST);
-  if ((uint32_t)mdnsIp != 0)
+  stallLogBoot(g_stallLog);
+  esp_reset_reason_t reason = esp_reset_reason();
+  g_resetReason = resetReasonName(reason);
+  StallRecord *cause = stallLogFind(g_stallLog, g_stallLog.crashSeq);
+  if (cause)
   {
-    g_mqttIp = mdnsIp;
-    g_mqttIpValid = true;
-    g_dnsBackoffMs = 5000;
-    return true;
+    stallCopyName(cause->reason, g_resetReason);
+    stallRecordSeal(*cause);
   }
+  else if (reason == ESP_RST_PANIC || reason == ESP_RST_INT_WDT || reason == ESP_RST_TASK_WDT ||
+           reason == ESP_RST_WDT || reason == ESP_RST_BROWNOUT)
+  {
+    StallRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = STALL_RESET;
+    stallCopyName(rec.reason, g_resetReason);
+    stallLogAdd(g_stallLog, rec);
+  }
+  g_stallLog.crashSeq = 0;
+  LOG(LOG_INFO, "Boot %lu, reset reason %s", (unsigned long)g_stallLog.boots, g_resetReason);
+
+  esp_timer_create_args_t args = {};
+  args.callback = onStallCheck;
+  args.name = "stall_check";
+  esp_timer_create(&args, &g_stallTimer);
+  esp_timer_start_periodic(g_stallTimer, STALL_CHECK_MS * 1000ULL);
+}
 
-  g_dnsBackoffMs = min(DNS_BACKOFF_MAX, g_dnsBackoffMs * 2);
-  return false;
+// loop() is the control task: instead of spinning it blocks until a producer
+// sets a wake bit or the next deadline (status second tick, MQTT coalescing
+// window, portal polling) is due.
+enum WakeReason : uint8_t
+{
+  WAKE_TIMER,   // deadline reached, no bit set
+  WAKE_COMMAND, // command queued by MQTT or HTTP
+  WAKE_INPUT,   // debounced tuning transition
+  WAKE_NETWORK, // Wi-Fi, MQTT connection or broker address changed
+  WAKE_COUNT
+};
+
+const char *const WAKE_NAME[WAKE_COUNT] = {"timer", "command", "input", "network"};
+
+TaskHandle_t g_loopTask = nullptr;
+TaskHandle_t g_webTask = nullptr;
+TaskHandle_t g_otaTask = nullptr;
+uint32_t g_wakeCount[WAKE_COUNT]; // loop()
+uint64_t g_controlIdleUs = 0;     // loop(): time spent blocked between events
+uint32_t g_controlIdleMs = 0;     // the same in ms, read by /metrics (single word)
+bool g_lightSleep = false;
+
+void controlWake(WakeReason reason)
+{
+  if (g_loopTask)
+    xTaskNotify(g_loopTask, 1UL << reason, eSetBits);
 }
 
-bool mqttPublishState(bool forceAll = false)
+time_t nowSec()
 {
-  if (!mqttClient.connected())
-    return false;
+  return g_clock.now();
+}
+
+bool isTimeValid()
+{
+  return nowSec() >= TIME_VALID_AFTER;
+}
 
-  String base = deviceBaseTopic();
-  bool power = readPower();
-  bool tuning = readTuning();
+// Tuning cycles and relay actions, written from the tuning timer and loop(),
+// read by the web task; every access is a short copy under g_historyMux.
+portMUX_TYPE g_historyMux = portMUX_INITIALIZER_UNLOCKED;
+History g_history = {};
 
-  g_timeValid = isTimeValid();
+uint32_t historyEpoch()
+{
   time_t now = nowSec();
-  String timeStr = g_timeValid ? formatTime(now) : ("Since Restart: " + formatUptime(millis() - g_bootMillis));
-  String lastResetStr = g_timeValid ? formatTime(g_lastReset) : String("-");
+  return now >= TIME_VALID_AFTER ? (uint32_t)now : 0;
+}
 
-  String tPower = base + "/power/state";
-  String tTune = base + "/tuning/state";
-  String tReset = base + "/lastReset/str";
-  String tTime = base + "/time/str";
+void recordHistory(uint8_t ch, HistoryKind kind, uint32_t arg = 0)
+{
+  uint32_t epoch = historyEpoch();
+  portENTER_CRITICAL(&g_historyMux);
+  historyAdd(g_history, ch, kind, millis(), epoch, arg);
+  portEXIT_CRITICAL(&g_historyMux);
+}
 
-  bool published = false;
+// Tuning input (yellow wire): the ISR only timestamps edges and (re)arms a
+// one-shot timer; the level is taken over once it stayed unchanged for
+// TUNING_DEBOUNCE_MS. Readers get the debounced state without waiting.
+// One debouncer per channel; the ISR and timer get the channel as argument.
+portMUX_TYPE g_tuningMux = portMUX_INITIALIZER_UNLOCKED;
+TuningState g_tuning[CHANNEL_COUNT] = {};
+volatile uint32_t g_tuningEdgeMs[CHANNEL_COUNT] = {};
+esp_timer_handle_t g_tuningTimer[CHANNEL_COUNT] = {};
+DRAM_ATTR uint8_t g_tuningPin[CHANNEL_COUNT] = {}; // CHANNELS lives in flash, the ISR reads this copy
+
+inline void *channelArg(uint8_t ch)
+{
+  return (void *)(uintptr_t)ch;
+}
 
-  // Power
-  if (forceAll || !g_mqttInitialPublishDone || g_lastPowerPublished != power)
-  {
-    mqttClient.publish(tPower.c_str(), 0, true, power ? "ON" : "OFF");
-    g_lastPowerPublished = power;
-    published = true;
-  }
+#if CG3000_POWER_SAVE
+// Light sleep only wakes on a GPIO level, so the tuning input runs as a level
+// interrupt that is flipped to the opposite level on every edge.
+inline void IRAM_ATTR armTuningWakeup(uint8_t pin, bool high)
+{
+  gpio_ll_wakeup_enable(&GPIO, (gpio_num_t)pin, high ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+}
+#endif
 
-  // Tuning
-  if (forceAll || !g_mqttInitialPublishDone || g_lastTuningPublished != tuning)
+void IRAM_ATTR onTuningEdge(void *arg)
+{
+  uint8_t ch = (uint8_t)(uintptr_t)arg;
+#if CG3000_POWER_SAVE
+  armTuningWakeup(g_tuningPin[ch], gpio_ll_get_level(&GPIO, (gpio_num_t)g_tuningPin[ch]));
+#endif
+  g_tuningEdgeMs[ch] = (uint32_t)(esp_timer_get_time() / 1000);
+  esp_timer_stop(g_tuningTimer[ch]); // restart the debounce window on chatter
+  esp_timer_start_once(g_tuningTimer[ch], TUNING_DEBOUNCE_MS * 1000ULL);
+}
+
+void onTuningSettled(void *arg)
+{
+  uint8_t ch = (uint8_t)(uintptr_t)arg;
+  bool active = digitalRead(CHANNELS[ch].tuning) == LOW;
+  uint32_t edgeMs = g_tuningEdgeMs[ch];
+  portENTER_CRITICAL(&g_tuningMux);
+  bool changed = tuningSettle(g_tuning[ch], active, edgeMs);
+  portEXIT_CRITICAL(&g_tuningMux);
+  if (!changed)
+    return;
+  uint32_t epoch = historyEpoch();
+  portENTER_CRITICAL(&g_historyMux);
+  historyTuning(g_history, ch, active, edgeMs, epoch);
+  portEXIT_CRITICAL(&g_historyMux);
+  controlWake(WAKE_INPUT);
+}
+
+void setupTuningInput()
+{
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
   {
-    mqttClient.publish(tTune.c_str(), 0, true, tuning ? "ON" : "OFF");
-    g_lastTuningPublished = tuning;
-    published = true;
+    uint8_t pin = CHANNELS[ch].tuning;
+    g_tuningPin[ch] = pin;
+    esp_timer_create_args_t args = {};
+    args.callback = onTuningSettled;
+    args.arg = channelArg(ch);
+    args.name = "tuning_debounce";
+    esp_timer_create(&args, &g_tuningTimer[ch]);
+
+    g_tuning[ch].active = digitalRead(pin) == LOW;
+    g_tuning[ch].lastChangeMs = millis();
+    attachInterruptArg(digitalPinToInterrupt(pin), onTuningEdge, channelArg(ch), CHANGE);
+#if CG3000_POWER_SAVE
+    armTuningWakeup(pin, digitalRead(pin) == HIGH);
+#endif
   }
+#if CG3000_POWER_SAVE
+  esp_sleep_enable_gpio_wakeup();
+#endif
+}
+
+TuningState tuningSnapshot(uint8_t ch)
+{
+  portENTER_CRITICAL(&g_tuningMux);
+  TuningState st = g_tuning[ch];
+  portEXIT_CRITICAL(&g_tuningMux);
+  return st;
+}
+
+bool readTuning(uint8_t ch)
+{
+  return tuningSnapshot(ch).active;
+}
+
+// Reset relay pulse: the relay is switched on immediately and a one-shot
+// esp_timer switches it off again, so no caller waits for the pulse.
+// A request while a pulse is running is rejected (the running pulse covers it).
 
-  // Last Reset (String-Cache)
-  if (forceAll || g_lastLastResetStr != lastResetStr)
+struct ResetPulse
+{
+  bool active;
+  uint32_t widthMs;
+  uint32_t startMs; // millis() when the relay was switched on
+  uint32_t endMs;   // millis() when it was switched off again
+  uint32_t count;
+  uint32_t rejected;
+};
+
+portMUX_TYPE g_pulseMux = portMUX_INITIALIZER_UNLOCKED;
+ResetPulse g_pulse[CHANNEL_COUNT] = {};
+esp_timer_handle_t g_pulseTimer[CHANNEL_COUNT] = {};
+
+void onResetPulseEnd(void *arg)
+{
+  uint8_t ch = (uint8_t)(uintptr_t)arg;
+  digitalWrite(CHANNELS[ch].reset, LOW);
+  portENTER_CRITICAL(&g_pulseMux);
+  g_pulse[ch].active = false;
+  g_pulse[ch].endMs = millis();
+  portEXIT_CRITICAL(&g_pulseMux);
+}
+
+void setupResetPulse()
+{
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
   {
-    g_lastLastResetStr = lastResetStr;
-    mqttClient.publish(tReset.c_str(), 0, true, lastResetStr.c_str());
-    published = true;
+    esp_timer_create_args_t args = {};
+    args.callback = onResetPulseEnd;
+    args.arg = channelArg(ch);
+    args.name = "reset_pulse";
+    esp_timer_create(&args, &g_pulseTimer[ch]);
   }
+}
+
+bool startResetPulse(uint8_t ch, uint32_t widthMs = RESET_PULSE_MS)
+{
+  widthMs = constrain(widthMs, RESET_PULSE_MIN_MS, RESET_PULSE_MAX_MS);
 
-  // Time (String-Cache)
-  if (forceAll || g_lastTimeStr != timeStr)
+  portENTER_CRITICAL(&g_pulseMux);
+  ResetPulse &pulse = g_pulse[ch];
+  if (pulse.active)
   {
-    g_lastTimeStr = timeStr;
-    mqttClient.publish(tTime.c_str(), 0, true, timeStr.c_str());
-    published = true;
+    pulse.rejected++;
+    portEXIT_CRITICAL(&g_pulseMux);
+    return false;
   }
+  pulse.active = true;
+  pulse.widthMs = widthMs;
+  pulse.startMs = millis();
+  pulse.count++;
+  g_persisted.resetPulses++;
+  portEXIT_CRITICAL(&g_pulseMux);
+
+  digitalWrite(CHANNELS[ch].reset, HIGH);
+  esp_timer_start_once(g_pulseTimer[ch], widthMs * 1000ULL);
+  g_lastReset[ch] = nowSec();
+  recordHistory(ch, HIST_RESET, widthMs);
+  return true;
+}
 
-  g_mqttInitialPublishDone = true;
-  return published;
+ResetPulse resetPulseSnapshot(uint8_t ch)
+{
+  portENTER_CRITICAL(&g_pulseMux);
+  ResetPulse p = g_pulse[ch];
+  portEXIT_CRITICAL(&g_pulseMux);
+  return p;
 }
 
-void mqttPublishDiscovery()
+bool readPower(uint8_t ch) {
+  return (digitalRead(CHANNELS[ch].power) == HIGH);
+}
+
+// The status snapshot is rebuilt by the loop (refreshStatus); readers take a copy.
+portMUX_TYPE g_statusMux = portMUX_INITIALIZER_UNLOCKED;
+StatusSnapshot g_status = {};
+
+void refreshStatus()
 {
-  String dev = String("{\"id\":\"") + g_deviceId + "\","
-                                                   "\"manufacturer\":\"CG-3000\",\"model\":\"ESP32 Remote\",\"name\":\"CG-3000 Remote\"}";
-  String base = deviceBaseTopic();
+  static StatusSnapshot next = {};
 
+  next.channels = CHANNEL_COUNT;
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
   {
-    String objId = g_deviceId + "_power";
-    String topic = String(HAM_DISCOVERY_PREFIX) + "/switch/" + objId + "/config";
-    String payload = String("{") + "\"id\":\"" + objId + "\"," + "\"cmd\":\"" + base + "/power/set\"," + "\"state\":\"" + base + "/power/state\"," + "\"device\":" + dev + "}";
-    mqttClient.publish(topic.c_str(), 0, true, payload.c_str());
+    next.power[ch] = readPower(ch);
+    next.tuning[ch] = readTuning(ch);
   }
+  next.mqttConnected = mqttClient.connected();
+  memcpy(next.rules, g_rules.config, sizeof(next.rules));
+
+  statusUpdateTime(next, nowSec(), millis() - g_bootMillis, g_lastReset);
+  bool changed = false;
 
+  // Statistics are only recomputed when a tuning cycle completed.
+  portENTER_CRITICAL(&g_historyMux);
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
   {
-    String objId = g_deviceId + "_reset";
-    String topic = String(HAM_DISCOVERY_PREFIX) + "/button/" + objId + "/config";
-    String payload = String("{") + "\"id\":\"" + objId + "\"," + "\"cmd\":\"" + base + "/reset/set\"," + "\"device\":" + dev + "}";
-    mqttClient.publish(topic.c_str(), 0, true, payload.c_str());
+    if (g_history.tuneCount[ch] != next.tune[ch].count)
+      tuneStats(g_history, ch, next.tune[ch]);
   }
+  portEXIT_CRITICAL(&g_historyMux);
 
+  portENTER_CRITICAL(&g_statusMux);
+  if (!sameStatus(next, g_status))
   {
-    String objId = g_deviceId + "_tuning";
-    String topic = String(HAM_DISCOVERY_PREFIX) + "/binary_sensor/" + objId + "/config";
-    String payload = String("{") + "\"id\":\"" + objId + "\"," + "\"state\":\"" + base + "/tuning/state\"," + "\"device\":" + dev + "}";
-    mqttClient.publish(topic.c_str(), 0, true, payload.c_str());
+    next.generation = g_status.generation + 1;
+    g_status = next;
+    changed = true;
   }
+  portEXIT_CRITICAL(&g_statusMux);
+  if (changed && g_webTask)
+    xTaskNotifyGive(g_webTask); // push to /events subscribers right away
+}
+
+StatusSnapshot statusSnapshot()
+{
+  portENTER_CRITICAL(&g_statusMux);
+  StatusSnapshot st = g_status;
+  portEXIT_CRITICAL(&g_statusMux);
+  return st;
+}
 
+// Feeds new log lines to the UART and MQTT sinks (if built in) without
+// waiting: a line the UART TX buffer cannot take is counted and skipped.
+uint32_t g_logSinkSeq = 0;      // loop()
+uint32_t g_logUartDropped = 0;  // loop()
+
+void logSinks()
+{
+#if CG3000_LOG_UART || CG3000_LOG_MQTT
+  uint32_t next = g_log.next.load(std::memory_order_acquire);
+  g_logSinkSeq = max(g_logSinkSeq, logOldest(g_log));
+  LogLine line;
+  while (g_logSinkSeq < next && logRead(g_log, g_logSinkSeq, line))
   {
-    String objId = g_deviceId + "_lastreset";
-    String topic = String(HAM_DISCOVERY_PREFIX) + "/sensor/" + objId + "/config";
-    String payload = String("{") + "\"id\":\"" + objId + "\"," + "\"state\":\"" + base + "/lastReset/str\"," + "\"type\":\"timestamp\"," + "\"device\":" + dev + "}";
-    mqttClient.publish(topic.c_str(), 0, true, payload.c_str());
+    g_logSinkSeq++;
+    char buf[LOG_TEXT_MAX + 32];
+    int n = min(formatLogLine(line, buf, sizeof(buf)), (int)sizeof(buf) - 1);
+#if CG3000_LOG_UART
+    if (Serial.availableForWrite() >= n)
+      Serial.write((const uint8_t *)buf, n);
+    else
+      g_logUartDropped++;
+#endif
+#if CG3000_LOG_MQTT
+    if (line.level >= LOG_WARN && mqttClient.connected())
+    {
+      buf[n - 1] = '\0'; // no newline in the payload
+      g_mqtt.publish(topic(0, TOPIC_LOG), buf, false);
+      g_mqttPub.publishCount[TOPIC_LOG]++;
+    }
+#endif
   }
+#endif
+}
+
+// Status beacon for fleet dashboards (see beacon.h), only with CG3000_BEACON:
+// loop() multicasts one datagram whenever the relay, tuning, lastReset or
+// broker state changes and every BEACON_HEARTBEAT_MS otherwise. Queries
+// (to the group or this device) are answered on the AsyncUDP task straight
+// from the status snapshot.
+#ifndef CG3000_BEACON
+#define CG3000_BEACON 0
+#endif
+
+#if CG3000_BEACON
+const IPAddress BEACON_GROUP(239, 255, 30, 0);
+const uint16_t BEACON_PORT = 30000;
+const uint32_t BEACON_HEARTBEAT_MS = 30000;
+
+AsyncUDP g_beaconUdp;
+std::atomic<uint32_t> g_beaconSeq{0};
+uint8_t g_firmwareHash[BEACON_FIRMWARE_SIZE];
+Beacon g_beaconSent = {};                 // loop(): state of the last multicast beacon
+uint32_t g_beaconSentMs = 0;              // loop()
+uint32_t g_beaconsSent = 0;               // loop()
+std::atomic<uint32_t> g_beaconReplies{0}; // AsyncUDP task
+
+size_t beaconBuild(Beacon &b, bool reply, uint8_t *buf, size_t len)
+{
+  memcpy(b.firmware, g_firmwareHash, sizeof(b.firmware));
+  snprintf(b.id, sizeof(b.id), "%s", g_deviceId.c_str());
+  if (reply)
+    b.flags |= BEACON_REPLY;
+  b.seq = ++g_beaconSeq;
+  return beaconEncode(b, buf, len);
+}
+
+void onBeaconPacket(AsyncUDPPacket &packet)
+{
+  if (!beaconIsQuery(packet.data(), packet.length()))
+    return;
+  Beacon b;
+  beaconFromStatus(b, statusSnapshot());
+  uint8_t buf[BEACON_MAX];
+  size_t n = beaconBuild(b, true, buf, sizeof(buf));
+  if (n > 0 && g_beaconUdp.writeTo(buf, n, packet.remoteIP(), packet.remotePort()) == n)
+    g_beaconReplies++;
+}
 
+void startBeacon()
+{
+  memcpy(g_firmwareHash, esp_ota_get_app_description()->app_elf_sha256, sizeof(g_firmwareHash));
+  if (!g_beaconUdp.listenMulticast(BEACON_GROUP, BEACON_PORT))
   {
-    String objId = g_deviceId + "_time";
-    String topic = String(HAM_DISCOVERY_PREFIX) + "/sensor/" + objId + "/config";
-    String payload = String("{") + "\"id\":\"" + objId + "\"," + "\"state\":\"" + base + "/time/str\"," + "\"type\":\"timestamp\"," + "\"device\":" + dev + "}";
-    mqttClient.publish(topic.c_str(), 0, true, payload.c_str());
+    LOG(LOG_ERROR, "Beacon: cannot listen on port %u", BEACON_PORT);
+    return;
   }
+  g_beaconUdp.onPacket(onBeaconPacket);
 }
 
-void onMqttConnect(bool sessionPresent)
+void beaconLoop()
 {
-  String base = deviceBaseTopic();
-  mqttClient.subscribe(String(base + "/power/set").c_str(), 0);
-  mqttClient.subscribe(String(base + "/reset/set").c_str(), 0);
-
-  mqttPublishDiscovery();
+  if (!g_beaconUdp.connected())
+    return;
+  Beacon b;
+  beaconFromStatus(b, statusSnapshot());
+  uint32_t nowMs = millis();
+  if (g_beaconsSent > 0 && !beaconChanged(b, g_beaconSent) && nowMs - g_beaconSentMs < BEACON_HEARTBEAT_MS)
+    return;
+  uint8_t buf[BEACON_MAX];
+  size_t n = beaconBuild(b, false, buf, sizeof(buf));
+  if (n > 0)
+    g_beaconUdp.writeTo(buf, n, BEACON_GROUP, BEACON_PORT);
+  g_beaconSent = b;
+  g_beaconSentMs = nowMs;
+  g_beaconsSent++;
+}
+#endif
 
-  g_mqttInitialPublishDone = false;
-  mqttPublishState(true);         // alles initial senden
-  g_lastMqttHeartbeat = millis(); // Heartbeat-Timer starten
-  Serial.println("MQTT connected");
+// Restores the relay and counters before anything else runs; reading the
+// journal is a handful of small flash reads.
+void restoreState()
+{
+  uint32_t startUs = micros();
+  JournalState st = {};
+  bool restored = false;
+  const esp_partition_t *partition =
+      esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_PARTITION_SUBTYPE, JOURNAL_PARTITION);
+  if (partition)
+  {
+    static EspFlash flash(partition);
+    restored = journalOpen(g_journal, flash, st);
+  }
+  if (!restored)
+    st.power = g_prefs.getBool(PREF_POWER, false) ? 1 : 0; // no journal yet: earlier firmware stored it in NVS
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+  {
+    digitalWrite(CHANNELS[ch].power, (st.power >> ch) & 1 ? HIGH : LOW);
+    g_lastReset[ch] = st.lastReset[ch];
+  }
+  g_tuneCyclesBase = st.tuneCycles;
+
+  g_persisted = st;
+  g_persisted.boots++;
+  journalUpdate(g_journal, g_persisted, millis(), true);
+  LOG(LOG_INFO, "State %s in %lu us (boot %lu)%s", restored ? "restored" : "initialized",
+                (unsigned long)(micros() - startUs), (unsigned long)g_persisted.boots,
+                partition ? "" : ", no journal partition");
 }
 
-void onMqttDisconnect(AsyncMqttClientDisconnectReason reason)
+// Writes changed state to the journal; coalescing happens in journalUpdate().
+void journalLoop(bool force = false)
 {
-  if (reason == AsyncMqttClientDisconnectReason::TCP_DISCONNECTED || reason == AsyncMqttClientDisconnectReason::TLS_BAD_FINGERPRINT)
+  uint8_t power = 0;
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
   {
-    g_mqttIpValid = false;
-    g_dnsBackoffMs = 5000;
+    power |= (readPower(ch) ? 1 : 0) << ch;
+    if (g_lastReset[ch] >= TIME_VALID_AFTER)
+      g_persisted.lastReset[ch] = (uint32_t)g_lastReset[ch];
   }
+  g_persisted.power = power;
+  uint32_t cycles = 0;
+  portENTER_CRITICAL(&g_historyMux);
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+    cycles += g_history.tuneCount[ch];
+  portEXIT_CRITICAL(&g_historyMux);
+  g_persisted.tuneCycles = g_tuneCyclesBase + cycles;
+  journalUpdate(g_journal, g_persisted, millis(), force);
 }
 
-void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)
+// Broker address: resolved on a background task (mDNS first, then unicast
+// DNS) so loop() never waits on a query. The last good address is kept in
+// NVS and used for the first connect after boot or a Wi-Fi drop.
+TaskHandle_t g_resolveTask = nullptr;
+std::atomic<uint32_t> g_resolvedIp{0}; // set by the resolver task, taken by loop()
+
+void requestMqttResolve()
 {
-  String t(topic);
-  String msg;
-  msg.reserve(len + 1);
-  for (size_t i = 0; i < len; ++i)
-    msg += payload[i];
+  if (g_resolveTask)
+    xTaskNotifyGive(g_resolveTask);
+}
 
-  String base = deviceBaseTopic();
+bool resolveMqttHost(IPAddress &ip)
+{
+  uint32_t startUs = micros();
+  stageEnter(WATCH_RESOLVE, STAGE_RESOLVE, startUs);
+  ip = MDNS.queryHost(MQTT_HOST, MDNS_QUERY_TIMEOUT_MS);
+  bool resolved = (uint32_t)ip != 0 || (WiFi.hostByName(MQTT_HOST, ip) == 1 && (uint32_t)ip != 0);
+  stageExit(WATCH_RESOLVE);
+  observeSince(g_stageLatency[STAGE_RESOLVE], startUs);
+  return resolved;
+}
 
-  if (t == base + "/power/set")
+void resolveTask(void *)
+{
+  for (;;)
   {
-    int current = digitalRead(PIN_RELAY_POWER);
-    bool newState = (current == HIGH);
-    if (msg == "TOGGLE")
-      newState = !newState;
-    else if (msg == "ON")
-      newState = true;
-    else if (msg == "OFF")
-      newState = false;
-    else
-      return;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-    if (((digitalRead(PIN_RELAY_POWER) == HIGH) != newState))
-    {
-      digitalWrite(PIN_RELAY_POWER, newState ? HIGH : LOW);
-    }
-    if (g_lastPowerPublished != newState || !g_mqttInitialPublishDone)
+    IPAddress ip;
+    uint32_t backoffMs = DNS_BACKOFF_MIN;
+    g_dnsAttempts++;
+    while (!resolveMqttHost(ip))
     {
-      String baseTopic = deviceBaseTopic();
-      mqttClient.publish(String(baseTopic + "/power/state").c_str(), 0, true, newState ? "ON" : "OFF");
-      g_lastPowerPublished = newState;
-      g_mqttInitialPublishDone = true;
+      g_dnsFailures++;
+      g_dnsBackoffMs = backoffMs;
+      // A new request (e.g. Wi-Fi back) cuts the wait short.
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(backoffMs));
+      backoffMs = min(DNS_BACKOFF_MAX, backoffMs * 2);
+      g_dnsAttempts++;
     }
-    return;
-  }
+    g_dnsBackoffMs = 0;
 
-  if (t == base + "/reset/set")
-  {
-    digitalWrite(PIN_RELAY_RESET, HIGH);
-    delay(250);
-    digitalWrite(PIN_RELAY_RESET, LOW);
-    g_lastReset = nowSec();
-    mqttPublishState();
-    return;
+    if (g_prefs.getUInt(PREF_MQTT_IP, 0) != (uint32_t)ip)
+      g_prefs.putUInt(PREF_MQTT_IP, (uint32_t)ip);
+    g_resolvedIp.store((uint32_t)ip);
+    controlWake(WAKE_NETWORK);
   }
 }
 
-void handleRoot()
+void setupMqttResolver()
 {
-  server.send(200, "text/html", htmlPage());
+  uint32_t cached = g_prefs.getUInt(PREF_MQTT_IP, 0);
+  if (cached != 0)
+  {
+    g_mqttIp = cached;
+    g_mqttIpValid = true;
+  }
+  xTaskCreatePinnedToCore(resolveTask, "resolve", 4096, nullptr, 1, &g_resolveTask, 0);
+  requestMqttResolve(); // refresh the cached address in the background
 }
 
-void handleStatus()
+bool mqttPublishState(bool forceAll = false)
 {
-  bool power = readPower();
-  bool tuning = readTuning();
+  return mqttPublishChanges(g_mqttPub, g_mqtt, g_mqttTopics, statusSnapshot(), forceAll, millis());
+}
 
-  g_timeValid = isTimeValid();
+// Discovery configs: the retained copies the broker returns after connect
+// are hashed by onMqttMessage (AsyncTCP task); DISCOVERY_SETTLE_MS later
+// loop() publishes only the configs that are missing or differ.
+const uint32_t DISCOVERY_SETTLE_MS = 1000;
+DiscoveryState g_discovery = {};
+bool g_discoveryPending = false; // loop()
+uint32_t g_discoveryDueMs = 0;
 
-  time_t now = nowSec();
-  String timeStr;
-  if (g_timeValid) {
-    timeStr = formatTime(now);
-  } else {
-    timeStr = "Since Restart: " + formatUptime(millis() - g_bootMillis);
-  }
-
-  String lastResetStr = g_timeValid ? formatTime(g_lastReset) : String("-");
-
-  String json = "{";
-  json += "\"power\":" + String(power ? "true" : "false") + ",";
-  json += "\"tuning\":" + String(tuning ? "true" : "false") + ",";
-  json += "\"lastReset\":" + String((long)g_lastReset) + ",";
-  json += "\"time\":" + String((long)now) + ",";
-  json += "\"lastResetStr\":\"" + lastResetStr + "\",";
-  json += "\"timeValid\":" + String(g_timeValid ? "true" : "false") + ",";
-  json += "\"timeStr\":\"" + timeStr + "\",";
-  json += "\"mqttConnected\":" + String(mqttClient.connected() ? "true" : "false");
-  json += "}";
-  server.send(200, "application/json", json);
-}
-
-void handleReset()
-{
-  digitalWrite(PIN_RELAY_RESET, HIGH);
-  delay(250);
-  digitalWrite(PIN_RELAY_RESET, LOW);
-  g_lastReset = nowSec();
-  if (mqttClient.connected())
-    mqttPublishState();
-  server.sendHeader("Location", "/");
-  server.send(303);
+void subscribeDiscovery(bool subscribe)
+{
+  char topic[DISCOVERY_TOPIC_MAX];
+  uint8_t slots = discoverySlotCount(CHANNEL_COUNT);
+  for (uint8_t slot = 0; slot < slots; ++slot)
+  {
+    if (!discoveryTopic(topic, sizeof(topic), g_deviceId.c_str(), slot))
+      continue;
+    if (subscribe)
+      mqttClient.subscribe(topic, 0);
+    else
+      mqttClient.unsubscribe(topic);
+  }
 }
 
-void handlePower()
+void mqttPublishDiscovery()
 {
-  int current = digitalRead(PIN_RELAY_POWER);
-  digitalWrite(PIN_RELAY_POWER, current == HIGH ? LOW : HIGH);
-  if (mqttClient.connected())
-    mqttPublishState();
-  server.sendHeader("Location", "/");
-  server.send(303);
+  subscribeDiscovery(false); // our own publishes need not come back
+  uint8_t sent = discoveryPublish(g_discovery, g_mqtt, g_deviceId.c_str(), g_mqttTopics, CHANNEL_COUNT);
+  LOG(LOG_INFO, "Discovery: %u of %u configs published", sent, discoverySlotCount(CHANNEL_COUNT));
 }
 
-void saveConfigCallback()
+// Commands from the MQTT callbacks (AsyncTCP task) and the web task to loop().
+// Producers serialize on a short spinlock around the push; only loop() pops,
+// so the consumer never locks and no producer touches relays or state.
+CommandQueue g_cmdQueue;
+portMUX_TYPE g_cmdPushMux = portMUX_INITIALIZER_UNLOCKED;
+
+bool commandPush(CommandType type, uint8_t channel, uint16_t arg = 0, uint8_t trace = TRACE_NONE)
 {
-  Serial.println("New WiFi config saved, please restart...");
-  shouldRestart = true;
+  uint32_t rxUs = micros();
+  portENTER_CRITICAL(&g_cmdPushMux);
+  bool queued = commandQueuePush(g_cmdQueue, {type, channel, arg, trace, rxUs});
+  portEXIT_CRITICAL(&g_cmdPushMux);
+  if (queued)
+    controlWake(WAKE_COMMAND);
+  return queued;
 }
 
-void WiFiEvent(WiFiEvent_t event)
+// Commands with a correlation id (see trace.h). The producers and loop()
+// share the table under g_traceMux; loop() sends the acks.
+TraceTable g_trace = {};
+portMUX_TYPE g_traceMux = portMUX_INITIALIZER_UNLOCKED;
+LatencyHistogram g_commandRelayLatency; // loop(): receipt -> handled, all commands
+LatencyHistogram g_commandAckLatency;   // loop(): receipt -> ack sent, traced commands
+
+// Queues a command that carries an id, unless the producer already knows
+// the outcome (early: invalid payload, pulse running, ...) or it is a retry
+// of an id seen before (duplicate). Returns true if it was queued; every
+// other outcome is acked by loop() as well.
+bool commandPushTraced(const char *id, size_t idLen, TraceSource source, const Command &cmd, TraceResult early,
+                       bool &duplicate)
 {
-  if (event == WIFI_EVENT_STA_DISCONNECTED)
+  uint32_t nowMs = millis();
+  uint32_t nowUs = micros();
+  portENTER_CRITICAL(&g_traceMux);
+  uint8_t slot = traceBegin(g_trace, id, idLen, source, cmd, early != TRACE_INVALID, nowMs, nowUs, duplicate);
+  portEXIT_CRITICAL(&g_traceMux);
+  if (slot == TRACE_NONE)
   {
-    g_mqttIpValid = false;
-    g_dnsBackoffMs = 5000;
+    LOG(LOG_WARN, "Command %.*s dropped: all %u trace slots in flight", (int)idLen, id, TRACE_SLOTS);
+    return false;
   }
-  if (event == IP_EVENT_STA_GOT_IP)
+  if (!duplicate && early == TRACE_PENDING && commandPush(cmd.type, cmd.channel, cmd.arg, slot))
+    return true;
+  if (!duplicate)
   {
-    // try DNS again on next loop.
+    portENTER_CRITICAL(&g_traceMux);
+    traceFinish(g_trace, slot, early == TRACE_PENDING ? TRACE_QUEUE_FULL : early, 0);
+    portEXIT_CRITICAL(&g_traceMux);
   }
+  controlWake(WAKE_COMMAND); // loop() sends the ack
+  return false;
 }
 
-void setup()
+// Publishes the due acks (QoS 1, not retained) on channel 1's ack topic.
+// Without a broker they are dropped so in-flight slots are freed; /ack
+// still has them.
+void publishAcks()
 {
-  Serial.begin(115200);
-  g_bootMillis = millis();
-
-  pinMode(PIN_STATUS_TUNING, INPUT_PULLUP);
-  pinMode(PIN_RELAY_RESET, OUTPUT);
-  pinMode(PIN_RELAY_POWER, OUTPUT);
-
-  digitalWrite(PIN_RELAY_RESET, LOW);
-  digitalWrite(PIN_RELAY_POWER, LOW);
-
-  wm.setSaveConfigCallback(saveConfigCallback);
-  wm.setHostname("CG3000-ESP32");
-  wm.setConnectRetries(3);
-  wm.setConnectTimeout(20);
-  wm.setConfigPortalTimeout(300);
-  wm.setEnableConfigPortal(true);
-
-  if (!wm.autoConnect("CG3000-Setup", "tuner1234"))
+  TraceEntry ack;
+  char buf[256];
+  for (;;)
   {
-    Serial.println("AP-Modus active.");
+    portENTER_CRITICAL(&g_traceMux);
+    bool due = traceTakeAck(g_trace, ack, micros());
+    portEXIT_CRITICAL(&g_traceMux);
+    if (!due)
+      break;
+    if (!ack.duplicate)
+      histogramObserve(g_commandAckLatency, ack.ackUs - ack.rxUs);
+    if (!mqttClient.connected() || formatTraceAck(ack, buf, sizeof(buf)) == 0)
+      continue;
+    mqttClient.publish(topic(0, TOPIC_ACK), 1, false, buf);
+    g_mqttPub.publishCount[TOPIC_ACK]++;
   }
-  else
+}
+
+// Publishes the stall records not reported yet (QoS 1, not retained) on
+// channel 1's stall topic, oldest first. A stall still going on waits until
+// it ended so the duration is final.
+void publishStalls()
+{
+  StallRecord rec;
+  char buf[512];
+  for (;;)
   {
-    Serial.println("WiFi connected.");
+    portENTER_CRITICAL(&g_stallMux);
+    bool found = stallLogNext(g_stallLog, g_stallLog.published, rec);
+    portEXIT_CRITICAL(&g_stallMux);
+    if (!found)
+      break;
+    for (const StallWatch &w : g_watch)
+    {
+      if (w.recordSeq == rec.seq)
+        return;
+    }
+    if (stallRecordValid(rec) && formatStallRecord(rec, buf, sizeof(buf)) > 0)
+    {
+      mqttClient.publish(topic(0, TOPIC_STALL), 1, false, buf);
+      g_mqttPub.publishCount[TOPIC_STALL]++;
+    }
+    g_stallLog.published = rec.seq;
+  }
+}
 
-    configTzTime("CET-1CEST,M3.5.0/2,M10.5.0/3", "pool.ntp.org", "time.nist.gov");
+// Connection events from the AsyncTCP / WiFi event tasks, handled in loop().
+std::atomic<bool> g_mqttJustConnected{false};
+std::atomic<bool> g_brokerLost{false};
 
-    struct tm tmInfo;
-    for (int i = 0; i < 20; ++i)
+void onMqttConnect(bool sessionPresent)
+{
+  uint32_t startUs = micros();
+  stageEnter(WATCH_ASYNC_TCP, STAGE_ASYNC_TCP, startUs);
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+  {
+    for (const Entity &e : ENTITIES)
     {
-      if (getLocalTime(&tmInfo, 500))
-        break;
-      delay(200);
+      if (e.commandTopic != TOPIC_NONE && entityOnChannel(e, ch))
+        mqttClient.subscribe(topic(ch, (TopicId)e.commandTopic), 1); // retried until the device has it
     }
-    g_timeValid = isTimeValid();
-    Serial.printf("Time valid: %s\n", g_timeValid ? "yes" : "no");
   }
+  discoveryReset(g_discovery);
+  subscribeDiscovery(true);
+  g_mqttJustConnected = true; // discovery + full publish from loop()
+  g_mqttConnects++;
+  controlWake(WAKE_NETWORK);
+  LOG(LOG_INFO, "MQTT connected");
+  stageExit(WATCH_ASYNC_TCP);
+  observeSince(g_stageLatency[STAGE_ASYNC_TCP], startUs);
+}
 
-  WiFi.onEvent(WiFiEvent);
-
-  if (shouldRestart)
+void onMqttDisconnect(AsyncMqttClientDisconnectReason reason)
+{
+  g_mqttDisconnects++;
+  LOG(LOG_WARN, "MQTT disconnected (reason %d)", (int)reason);
+  controlWake(WAKE_NETWORK);
+  if (reason == AsyncMqttClientDisconnectReason::TCP_DISCONNECTED || reason == AsyncMqttClientDisconnectReason::TLS_BAD_FINGERPRINT)
   {
-    delay(1000);
-    ESP.restart();
+    g_brokerLost = true;
   }
+}
 
-  g_deviceId = "cg3000-" + chipId();
+void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)
+{
+  // Commands and discovery configs are small; ignore anything delivered in fragments.
+  if (index != 0 || len != total)
+    return;
 
-  if (!MDNS.begin("cg3000-esp32"))
+  uint32_t startUs = micros();
+  stageEnter(WATCH_ASYNC_TCP, STAGE_ASYNC_TCP, startUs);
+  Command cmd = {};
+  const char *value, *id;
+  size_t valueLen, idLen;
+  if (!discoveryRetained(g_discovery, g_deviceId.c_str(), CHANNEL_COUNT, topic, payload, len) &&
+      traceUnwrap(payload, len, value, valueLen, id, idLen))
   {
-    // still silent to avoid spam
+    bool valid = mqttCommand(g_mqttTopics, CHANNEL_COUNT, topic, value, valueLen, cmd);
+    bool duplicate;
+    if (idLen)
+      commandPushTraced(id, idLen, TRACE_MQTT, cmd, valid ? TRACE_PENDING : TRACE_INVALID, duplicate);
+    else if (valid)
+      commandPush(cmd.type, cmd.channel, cmd.arg);
   }
+  stageExit(WATCH_ASYNC_TCP);
+  uint32_t endUs = observeSince(g_mqttMessageLatency, startUs);
+  histogramObserve(g_stageLatency[STAGE_ASYNC_TCP], endUs - startUs);
+}
 
-  mqttClient.onConnect(onMqttConnect);
-  mqttClient.onDisconnect(onMqttDisconnect);
-  mqttClient.onMessage(onMqttMessage);
+void loadRules()
+{
+  RuleConfig config[CHANNEL_COUNT];
+  if (g_prefs.getBytesLength(PREF_RULES) != sizeof(config) || !g_prefs.getBytes(PREF_RULES, config, sizeof(config)))
+    return; // none saved yet (or for another channel table): all rules off
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+  {
+    for (uint8_t rule = 0; rule < RULE_COUNT; ++rule)
+      rulesConfigure(g_rules, ch, (RuleKind)rule, config[ch].value[rule], millis());
+  }
+}
 
-  server.on("/", handleRoot);
-  server.on("/status", handleStatus);
-  server.on("/reset", HTTP_POST, handleReset);
-  server.on("/power", HTTP_POST, handlePower);
+void saveRules()
+{
+  g_prefs.putBytes(PREF_RULES, g_rules.config, CHANNEL_COUNT * sizeof(RuleConfig));
+}
 
-  server.onNotFound([]()
-                    {
-    Serial.printf("404 for: %s %s\n",
-                  server.method() == HTTP_GET ? "GET" :
-                  server.method() == HTTP_POST ? "POST" : "OTHER",
-                  server.uri().c_str());
-    server.send(404, "text/plain", "Not found"); });
+bool applyPower(uint8_t ch, CommandType type)
+{
+  if (!applyPowerCommand(g_gpio, CHANNELS[ch].power, type))
+    return false;
+  g_persisted.powerSwitches++;
+  if (!g_journal.flash && ch == 0)
+    g_prefs.putBool(PREF_POWER, readPower(0)); // restored on next boot
+  recordHistory(ch, readPower(ch) ? HIST_POWER_ON : HIST_POWER_OFF);
+  return true;
+}
 
-  server.begin();
+// Carries out one command from the queue.
+TraceResult applyCommand(const Command &cmd)
+{
+  uint8_t ch = cmd.channel;
+  if (ch >= CHANNEL_COUNT)
+    return TRACE_INVALID;
+  switch (cmd.type)
+  {
+  case CMD_POWER_ON:
+  case CMD_POWER_OFF:
+  case CMD_POWER_TOGGLE:
+    return applyPower(ch, cmd.type) ? TRACE_OK : TRACE_UNCHANGED;
+  case CMD_RESET:
+    if (!rulesAllowReset(g_rules, ch))
+    {
+      LOG(LOG_WARN, "Reset on channel %u refused while tuning (no_reset_tuning)", ch + 1);
+      return TRACE_REFUSED;
+    }
+    return startResetPulse(ch, cmd.arg) ? TRACE_OK : TRACE_BUSY;
+  case CMD_RULE_IDLE_OFF:
+  case CMD_RULE_TUNE_TIMEOUT:
+  case CMD_RULE_NO_RESET_TUNING:
+  {
+    RuleKind rule = ruleOfCommand(cmd.type);
+    if (g_rules.config[ch].value[rule] == cmd.arg)
+      return TRACE_UNCHANGED;
+    rulesConfigure(g_rules, ch, rule, cmd.arg, millis());
+    saveRules();
+    LOG(LOG_INFO, "Rule %s on channel %u set to %u", RULE_NAME[rule], ch + 1, cmd.arg);
+    return TRACE_OK;
+  }
+  }
+  return TRACE_INVALID;
 }
 
-void loop()
+// Drains the command queue; returns true if any command changed state.
+bool processCommands()
 {
-  server.handleClient();
+  bool changed = false;
+  Command cmd;
+  while (commandQueuePop(g_cmdQueue, cmd))
+  {
+    TraceResult result = applyCommand(cmd);
+    changed |= result == TRACE_OK;
+    uint32_t relayUs = observeSince(g_commandRelayLatency, cmd.rxUs);
+    if (cmd.trace != TRACE_NONE)
+    {
+      portENTER_CRITICAL(&g_traceMux);
+      traceFinish(g_trace, cmd.trace, result, relayUs);
+      portEXIT_CRITICAL(&g_traceMux);
+    }
+  }
+  return changed;
+}
 
-  if (!g_mqttIpValid)
+// Feeds the current relay and tuning state to the rules and carries out the
+// actions that became due. They act directly, like a command from loop()
+// itself; a tune_timeout reset is not subject to no_reset_tuning.
+bool rulesLoop()
+{
+  uint32_t nowMs = millis();
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+    rulesObserve(g_rules, ch, readPower(ch), readTuning(ch), nowMs);
+
+  bool changed = false;
+  RuleAction actions[TIMER_WHEEL_MAX];
+  uint8_t n = rulesAdvance(g_rules, nowMs, actions, TIMER_WHEEL_MAX);
+  for (uint8_t i = 0; i < n; ++i)
   {
-    resolveMqttHostNonBlocking();
+    uint8_t ch = actions[i].channel;
+    if (ch >= CHANNEL_COUNT)
+      continue;
+    LOG(LOG_INFO, "Rule %s on channel %u: %s", RULE_NAME[actions[i].rule], ch + 1,
+        actions[i].rule == RULE_IDLE_OFF ? "power off" : "reset");
+    if (actions[i].rule == RULE_IDLE_OFF)
+      changed |= applyPower(ch, CMD_POWER_OFF);
+    else if (actions[i].rule == RULE_TUNE_TIMEOUT)
+      changed |= startResetPulse(ch);
   }
+  return changed;
+}
 
-  if (g_mqttIpValid && !mqttClient.connected())
+void handleRoot()
+{
+  // Page is served straight from flash; revalidation via ETag avoids resending it.
+  server.sendHeader("ETag", INDEX_HTML_ETAG);
+  server.sendHeader("Cache-Control", "no-cache");
+  if (server.header("If-None-Match") == INDEX_HTML_ETAG)
   {
-    mqttClient.setServer(g_mqttIp, MQTT_PORT);
-    mqttClient.connect();
+    server.send(304);
+    return;
   }
+  server.sendHeader("Content-Encoding", "gzip");
+  server.send_P(200, "text/html", (PGM_P)INDEX_HTML_GZ, INDEX_HTML_GZ_LEN);
+}
 
-  unsigned long nowMs = millis();
-  static unsigned long lastCheck = 0;
+char g_statusJson[2560];
 
-  if (mqttClient.connected())
+// snprintf at buf + n that advances n; once the output does not fit, n is
+// set to len and later calls write nothing, so a chain only checks the end.
+void appendf(char *buf, size_t len, size_t &n, const char *fmt, ...)
+{
+  if (n >= len)
+    return;
+  va_list args;
+  va_start(args, fmt);
+  int w = vsnprintf(buf + n, len - n, fmt, args);
+  va_end(args);
+  n = (w < 0 || (size_t)w >= len - n) ? len : n + w;
+}
+
+// The top-level relay fields are channel 1 (the single-channel format);
+// "channels" lists every channel of the table.
+void handleStatus()
+{
+  StatusSnapshot st = statusSnapshot();
+  ResetPulse pulse = resetPulseSnapshot(0);
+  JournalState journal = g_persisted; // plain words written by loop(); a scrape may mix two updates
+  uint32_t nowMs = millis();
+  OtaUpdate &ota = g_ota; // progress words written by the OTA task, the same applies
+  size_t n = 0;
+  appendf(g_statusJson, sizeof(g_statusJson), n,
+          "{\"power\":%s,\"tuning\":%s,\"lastReset\":%ld,\"time\":%ld,"
+          "\"lastResetStr\":\"%s\",\"timeValid\":%s,\"timeStr\":\"%s\",\"mqttConnected\":%s,"
+          "\"resetPulse\":{\"active\":%s,\"widthMs\":%lu,\"startMs\":%lu,\"endMs\":%lu},"
+          "\"cmdQueue\":{\"depth\":%lu,\"maxDepth\":%lu,\"dropped\":%lu},"
+          "\"boot\":{\"ipMs\":%lu,\"timeMs\":%lu,\"ttfbMs\":%lu},"
+          "\"journal\":{\"boots\":%lu,\"resetPulses\":%lu,\"powerSwitches\":%lu,\"tuneCycles\":%lu,"
+          "\"writes\":%lu,\"compactions\":%lu,\"errors\":%lu},"
+          "\"ota\":{\"state\":\"%s\",\"bytes\":%lu,\"ms\":%lu,\"bytesPerSec\":%lu,\"flashMs\":%lu,"
+          "\"error\":\"%s\",\"partition\":\"%s\",\"trial\":%s,\"rollback\":\"%s\"},\"channels\":[",
+          st.power[0] ? "true" : "false", st.tuning[0] ? "true" : "false", (long)st.lastReset[0], (long)st.now,
+          st.lastResetStr[0], st.timeValid ? "true" : "false", st.timeStr, st.mqttConnected ? "true" : "false",
+          pulse.active ? "true" : "false", (unsigned long)pulse.widthMs, (unsigned long)pulse.startMs,
+          (unsigned long)pulse.endMs, (unsigned long)commandQueueDepth(g_cmdQueue),
+          (unsigned long)g_cmdQueue.maxDepth.load(), (unsigned long)g_cmdQueue.dropped.load(),
+          (unsigned long)g_bootIpMs, (unsigned long)g_bootTimeMs, (unsigned long)g_bootTtfbMs.load(),
+          (unsigned long)journal.boots, (unsigned long)journal.resetPulses,
+          (unsigned long)journal.powerSwitches, (unsigned long)journal.tuneCycles,
+          (unsigned long)g_journal.flushes, (unsigned long)g_journal.compactions,
+          (unsigned long)g_journal.errors, OTA_STATE_NAME[ota.state], (unsigned long)ota.received,
+          (unsigned long)otaElapsedMs(ota, nowMs), (unsigned long)otaBytesPerSec(ota, nowMs),
+          (unsigned long)(g_otaSlot.writeUs / 1000), ota.error ? ota.error : "",
+          esp_ota_get_running_partition()->label, g_otaTrial ? "true" : "false", g_otaRollback.c_str());
+  for (uint8_t ch = 0; ch < st.channels; ++ch)
+  {
+    appendf(g_statusJson, sizeof(g_statusJson), n,
+            "%s{\"power\":%s,\"tuning\":%s,\"lastReset\":%ld,\"lastResetStr\":\"%s\",\"resetActive\":%s,"
+            "\"rules\":{\"idle_off\":%u,\"tune_timeout\":%u,\"no_reset_tuning\":%s}}",
+            ch ? "," : "", st.power[ch] ? "true" : "false", st.tuning[ch] ? "true" : "false",
+            (long)st.lastReset[ch], st.lastResetStr[ch], resetPulseSnapshot(ch).active ? "true" : "false",
+            st.rules[ch].value[RULE_IDLE_OFF], st.rules[ch].value[RULE_TUNE_TIMEOUT],
+            st.rules[ch].value[RULE_NO_RESET_TUNING] ? "true" : "false");
+  }
+  appendf(g_statusJson, sizeof(g_statusJson), n, "],\"mqttPublish\":{");
+  for (uint8_t i = 0; i < TOPIC_COUNT; ++i)
+  {
+    appendf(g_statusJson, sizeof(g_statusJson), n, "%s\"%s\":%lu", i ? "," : "", TOPIC_SUFFIX[i] + 1,
+            (unsigned long)g_mqttPub.publishCount[i]);
+  }
+  appendf(g_statusJson, sizeof(g_statusJson), n, "}}");
+  if (n >= sizeof(g_statusJson))
+  {
+    LOG(LOG_ERROR, "/status does not fit into %u bytes", (unsigned)sizeof(g_statusJson));
+    server.send(500, "text/plain", "Status too large");
+    return;
+  }
+  server.send_P(200, "application/json", g_statusJson, n);
+}
+
+// Server-Sent Events: /events keeps the connection open and receives only
+// the fields that changed, plus a periodic time/uptime frame as keepalive.
+const uint8_t EVENTS_MAX_CLIENTS = 4;
+const unsigned long EVENTS_KEEPALIVE_MS = 15000UL;
+const size_t EVENTS_FRAME_MAX = 288; // "event: history\n" + "data: " + 256 byte payload + "\n\n"
+
+WiFiClient g_eventClients[EVENTS_MAX_CLIENTS];
+unsigned long g_lastEventsKeepalive = 0;
+
+StatusSnapshot g_lastPushed = {};
+
+// Stream writes never wait: returns the bytes the socket took (0 when its
+// send buffer is full) or -1 if the connection failed. WiFiClient::write
+// would block the web task until its timeout instead.
+int streamSend(WiFiClient &client, const char *data, size_t n)
+{
+  int fd = client.fd();
+  if (fd < 0)
+    return -1;
+  int sent = send(fd, data, n, MSG_DONTWAIT);
+  if (sent < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  return sent;
+}
+
+// A subscriber whose socket cannot take a whole frame right now is dropped;
+// the write itself never waits, so a stalled browser costs one failed send.
+bool eventsWrite(WiFiClient &client, const char *data, const char *event = nullptr)
+{
+  char frame[EVENTS_FRAME_MAX];
+  int n = event ? snprintf(frame, sizeof(frame), "event: %s\ndata: %s\n\n", event, data)
+                : snprintf(frame, sizeof(frame), "data: %s\n\n", data);
+  if (n <= 0 || n >= (int)sizeof(frame) || streamSend(client, frame, n) != n)
+  {
+    client.stop();
+    return false;
+  }
+  return true;
+}
+
+void eventsBroadcast(const char *data, const char *event = nullptr)
+{
+  for (uint8_t i = 0; i < EVENTS_MAX_CLIENTS; ++i)
+  {
+    if (!g_eventClients[i].connected())
+      continue;
+    eventsWrite(g_eventClients[i], data, event);
+  }
+}
+
+uint8_t eventsClientCount()
+{
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < EVENTS_MAX_CLIENTS; ++i)
+    if (g_eventClients[i].connected())
+      n++;
+  return n;
+}
+
+// Appends the relay fields of one channel that differ from prev (all of them
+// without prev), each followed by a comma. Like appendf, n reaches len once
+// the frame does not fit.
+void appendChannelFields(const StatusSnapshot &st, const StatusSnapshot *prev, uint8_t ch, char *buf, size_t len,
+                         size_t &n)
+{
+  if (!prev || st.power[ch] != prev->power[ch])
+    appendf(buf, len, n, "\"power\":%s,", st.power[ch] ? "true" : "false");
+  if (!prev || st.tuning[ch] != prev->tuning[ch])
+    appendf(buf, len, n, "\"tuning\":%s,", st.tuning[ch] ? "true" : "false");
+  if (!prev || st.lastReset[ch] != prev->lastReset[ch] || st.timeValid != prev->timeValid)
+    appendf(buf, len, n, "\"lastReset\":%ld,\"lastResetStr\":\"%s\",", (long)st.lastReset[ch],
+            st.lastResetStr[ch]);
+}
+
+// Channels after the first go out as their own frames tagged with "ch"
+// (0-based); returns false if nothing changed or the frame did not fit.
+bool formatChannelFrame(const StatusSnapshot &st, const StatusSnapshot *prev, uint8_t ch, char *buf, size_t len)
+{
+  size_t n = 0;
+  appendf(buf, len, n, "{\"ch\":%u,", ch);
+  size_t fieldsStart = n;
+  appendChannelFields(st, prev, ch, buf, len, n);
+  if (n == fieldsStart || n >= len)
+    return false;
+  n--; // drop trailing comma
+  appendf(buf, len, n, "}");
+  return n < len;
+}
+
+// Appends the time fields the page needs to run its own clock.
+void appendTimeFields(const StatusSnapshot &st, char *buf, size_t len, size_t &n)
+{
+  appendf(buf, len, n, "\"time\":%ld,\"timeValid\":%s,\"uptime\":%lu", (long)st.now,
+          st.timeValid ? "true" : "false", (unsigned long)st.uptimeSec);
+}
+
+void handleEvents()
+{
+  int slot = -1;
+  for (uint8_t i = 0; i < EVENTS_MAX_CLIENTS; ++i)
+  {
+    if (!g_eventClients[i].connected())
+    {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0)
+  {
+    // Page falls back to polling /status.
+    server.send(503, "text/plain", "Too many event subscribers");
+    return;
+  }
+
+  // Keep our own reference to the socket; WebServer drops its copy after the handler.
+  WiFiClient client = server.client();
+  static const char HEADERS[] = "HTTP/1.1 200 OK\r\n"
+                                "Content-Type: text/event-stream\r\n"
+                                "Cache-Control: no-cache\r\n"
+                                "Connection: keep-alive\r\n\r\n"
+                                "retry: 5000\n\n";
+  if (streamSend(client, HEADERS, sizeof(HEADERS) - 1) != (int)sizeof(HEADERS) - 1)
+  {
+    client.stop();
+    return;
+  }
+
+  StatusSnapshot st = statusSnapshot();
+  char buf[256];
+  size_t n = 0;
+  appendf(buf, sizeof(buf), n, "{");
+  appendChannelFields(st, nullptr, 0, buf, sizeof(buf), n);
+  appendf(buf, sizeof(buf), n, "\"mqttConnected\":%s,", st.mqttConnected ? "true" : "false");
+  appendTimeFields(st, buf, sizeof(buf), n);
+  appendf(buf, sizeof(buf), n, "}");
+  if (n < sizeof(buf) && !eventsWrite(client, buf)) // a frame that did not fit is skipped
+    return;
+  for (uint8_t ch = 1; ch < st.channels; ++ch)
+  {
+    if (formatChannelFrame(st, nullptr, ch, buf, sizeof(buf)) && !eventsWrite(client, buf))
+      return;
+  }
+  g_eventClients[slot] = client;
+}
+
+int formatHistoryEvent(const HistoryEvent &ev, char *buf, size_t len)
+{
+  return snprintf(buf, len, "{\"seq\":%lu,\"ch\":%u,\"kind\":\"%s\",\"ms\":%lu,\"epoch\":%lu,\"arg\":%lu}",
+                  (unsigned long)ev.seq, ev.channel, HISTORY_KIND_NAME[ev.kind], (unsigned long)ev.ms,
+                  (unsigned long)ev.epoch, (unsigned long)ev.arg);
+}
+
+// History entries are copied out in small batches so g_historyMux is only
+// held for a few struct copies, never across a socket write.
+const uint8_t HISTORY_COPY_BATCH = 8;
+
+uint8_t historyCopy(uint32_t &seq, uint32_t end, HistoryEvent *out)
+{
+  uint8_t n = 0;
+  portENTER_CRITICAL(&g_historyMux);
+  if (seq < historyOldest(g_history))
+    seq = historyOldest(g_history); // overwritten while we were sending
+  while (n < HISTORY_COPY_BATCH && seq < end && historyGet(g_history, seq, out[n]))
+  {
+    n++;
+    seq++;
+  }
+  portEXIT_CRITICAL(&g_historyMux);
+  return n;
+}
+
+uint32_t historyNext()
+{
+  portENTER_CRITICAL(&g_historyMux);
+  uint32_t next = g_history.next;
+  portEXIT_CRITICAL(&g_historyMux);
+  return next;
+}
+
+// New history entries go to the subscribers as "history" events, which the
+// page's onmessage handler does not see.
+uint32_t g_eventsHistorySeq = 0;
+
+void eventsHistory()
+{
+  HistoryEvent batch[HISTORY_COPY_BATCH];
+  uint8_t n = historyCopy(g_eventsHistorySeq, UINT32_MAX, batch);
+  char buf[128];
+  for (uint8_t i = 0; i < n; ++i)
+  {
+    formatHistoryEvent(batch[i], buf, sizeof(buf));
+    eventsBroadcast(buf, "history");
+  }
+}
+
+void eventsLoop()
+{
+  if (eventsClientCount() == 0)
+  {
+    g_eventsHistorySeq = historyNext(); // subscribers page /history for the past
+    return;
+  }
+  eventsHistory();
+
+  unsigned long nowMs = millis();
+  bool keepalive = false;
+  if (nowMs - g_lastEventsKeepalive >= EVENTS_KEEPALIVE_MS)
+  {
+    g_lastEventsKeepalive = nowMs;
+    keepalive = true;
+  }
+
+  StatusSnapshot st = statusSnapshot();
+  if (!keepalive && st.generation == g_lastPushed.generation)
+    return;
+
+  char buf[256];
+  for (uint8_t ch = 1; ch < st.channels; ++ch)
+  {
+    if (formatChannelFrame(st, ch < g_lastPushed.channels ? &g_lastPushed : nullptr, ch, buf, sizeof(buf)))
+      eventsBroadcast(buf);
+  }
+
+  size_t n = 0;
+  appendf(buf, sizeof(buf), n, "{");
+  appendChannelFields(st, &g_lastPushed, 0, buf, sizeof(buf), n);
+  if (st.mqttConnected != g_lastPushed.mqttConnected)
+    appendf(buf, sizeof(buf), n, "\"mqttConnected\":%s,", st.mqttConnected ? "true" : "false");
+
+  bool changed = n > 1;
+  bool timeChanged = st.timeValid != g_lastPushed.timeValid;
+  g_lastPushed = st;
+  if (!changed && !keepalive)
+    return;
+
+  if (n >= sizeof(buf))
+    return; // the frame did not fit: skipped
+  if (keepalive || timeChanged)
+    appendTimeFields(st, buf, sizeof(buf), n);
+  else
+    n--; // drop trailing comma
+  appendf(buf, sizeof(buf), n, "}");
+  if (n < sizeof(buf))
+    eventsBroadcast(buf);
+}
+
+// GET /log?follow=1 subscribers: the web task writes new lines to them as
+// they appear. A full send buffer leaves the line for the next pass (lines
+// the ring overwrites meanwhile are skipped); a broken write drops it.
+const uint8_t LOG_MAX_FOLLOWERS = 2;
+WiFiClient g_logFollowers[LOG_MAX_FOLLOWERS];
+uint32_t g_logFollowSeq[LOG_MAX_FOLLOWERS];
+LogLevel g_logFollowLevel[LOG_MAX_FOLLOWERS];
+
+void logFollowLoop()
+{
+  uint32_t next = g_log.next.load(std::memory_order_acquire);
+  for (uint8_t i = 0; i < LOG_MAX_FOLLOWERS; ++i)
+  {
+    WiFiClient &client = g_logFollowers[i];
+    uint32_t &seq = g_logFollowSeq[i];
+    while (client.connected() && seq < next)
+    {
+      seq = max(seq, logOldest(g_log));
+      LogLine line;
+      if (!logRead(g_log, seq, line))
+      {
+        if (seq >= logOldest(g_log))
+          break; // still being written, retry on the next pass
+        continue;
+      }
+      if (line.level < g_logFollowLevel[i])
+      {
+        seq++;
+        continue;
+      }
+      char buf[LOG_TEXT_MAX + 32];
+      int n = min(formatLogLine(line, buf, sizeof(buf)), (int)sizeof(buf) - 1);
+      int sent = streamSend(client, buf, n);
+      if (sent == 0)
+        break; // send buffer full, retry this line on the next pass
+      if (sent != n)
+        client.stop();
+      seq++;
+    }
+  }
+}
+
+// Control handlers run on the web task; they only queue commands for loop(),
+// which owns the relays, status refresh and MQTT publishing.
+
+// An optional id= parameter traces the command like an MQTT command with a
+// correlation id: the outcome is acked on the MQTT ack topic and kept for
+// GET /ack, and a retry with the same id is answered without running it
+// again. Returns false if the request was already answered.
+bool pushHttpCommand(CommandType type, uint8_t ch, uint16_t arg, TraceResult early)
+{
+  String id = server.arg("id");
+  bool queued = false;
+  bool duplicate = false;
+  if (id.length())
+  {
+    if (!traceIdValid(id.c_str(), id.length()))
+    {
+      server.send(400, "text/plain", "Bad id");
+      return false;
+    }
+    server.sendHeader("X-Command-Id", id);
+    queued = commandPushTraced(id.c_str(), id.length(), TRACE_HTTP, {type, ch, arg, TRACE_NONE, micros()}, early,
+                               duplicate);
+  }
+  else if (early == TRACE_PENDING)
+    queued = commandPush(type, ch, arg);
+  if (queued || duplicate)
+    return true;
+  if (early == TRACE_BUSY)
+    server.send(409, "text/plain", "Reset pulse already running");
+  else if (early == TRACE_REFUSED)
+    server.send(409, "text/plain", "Reset refused while tuning (no_reset_tuning rule)");
+  else
+    server.send(503, "text/plain", "Command queue full");
+  return false;
+}
+
+void handleReset(uint8_t ch)
+{
+  uint32_t widthMs = RESET_PULSE_MS;
+  if (server.hasArg("ms"))
+  {
+    // A malformed width must not fire the relay, so it is refused, not clamped.
+    String arg = server.arg("ms");
+    char *end;
+    long ms = strtol(arg.c_str(), &end, 10);
+    if (end == arg.c_str() || *end != '\0' || ms < (long)RESET_PULSE_MIN_MS || ms > (long)RESET_PULSE_MAX_MS)
+    {
+      server.send(400, "text/plain", "Invalid ms (50-2000)");
+      return;
+    }
+    widthMs = ms;
+  }
+  StatusSnapshot st = statusSnapshot();
+  TraceResult early = TRACE_PENDING;
+  if (resetPulseSnapshot(ch).active)
+    early = TRACE_BUSY;
+  else if (st.rules[ch].value[RULE_NO_RESET_TUNING] && st.tuning[ch])
+    early = TRACE_REFUSED;
+  if (!pushHttpCommand(CMD_RESET, ch, (uint16_t)widthMs, early))
+    return;
+  server.sendHeader("Location", "/");
+  server.send(303);
+}
+
+void handlePower(uint8_t ch)
+{
+  if (!pushHttpCommand(CMD_POWER_TOGGLE, ch, 0, TRACE_PENDING))
+    return;
+  server.sendHeader("Location", "/");
+  server.send(303);
+}
+
+// HTTP runs on its own task on the protocol core, so DNS, MQTT reconnects
+// or relay handling in loop() can no longer freeze the UI (and vice versa).
+// Streams (/events, /log?follow=1) never block this task, but WebServer still
+// serves one request at a time: a client that stalls mid-request delays the
+// next one up to its read wait (HTTP_MAX_DATA_WAIT, 5 s).
+const BaseType_t WEB_TASK_CORE = 0;
+const uint32_t WEB_TASK_STACK = 6144;
+const UBaseType_t WEB_TASK_PRIORITY = 1;
+
+const uint32_t WEB_IDLE_POLL_MS = 20;
+
+void webTask(void *)
+{
+  for (;;)
+  {
+    uint32_t t = micros();
+    stageEnter(WATCH_WEB, STAGE_HTTP, t);
+    server.handleClient();
+    t = observeSince(g_stageLatency[STAGE_HTTP], t);
+    stageEnter(WATCH_WEB, STAGE_EVENTS, t);
+    eventsLoop();
+    logFollowLoop();
+    observeSince(g_stageLatency[STAGE_EVENTS], t);
+    stageExit(WATCH_WEB);
+    // WebServer can only be polled: stay quick while a client is being
+    // served, otherwise sleep until the next poll or a status change.
+    if (server.client().connected())
+      vTaskDelay(1);
+    else
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(WEB_IDLE_POLL_MS));
+  }
+}
+
+void handleNotFound()
+{
+  LOG(LOG_WARN, "404 for: %s %s",
+                server.method() == HTTP_GET ? "GET" :
+                server.method() == HTTP_POST ? "POST" : "OTHER",
+                server.uri().c_str());
+  server.send(404, "text/plain", "Not found");
+}
+
+// Chunked responses (/metrics, /history) are streamed from one fixed buffer.
+struct ChunkWriter
+{
+  char buf[1536]; // holds one histogram (~1.3 KB for the longest name)
+  size_t n = 0;
+
+  void flush()
+  {
+    if (n > 0)
+      server.sendContent(buf, n);
+    n = 0;
+  }
+
+  // Output that does not fit behind what is buffered is formatted again
+  // into the empty buffer, so a line is never cut; one longer than the
+  // buffer is dropped whole.
+  void printf(const char *fmt, ...)
+  {
+    va_list args, retry;
+    va_start(args, fmt);
+    va_copy(retry, args);
+    int w = vsnprintf(buf + n, sizeof(buf) - n, fmt, args);
+    if (w >= 0 && (size_t)w >= sizeof(buf) - n && n > 0)
+    {
+      flush();
+      w = vsnprintf(buf, sizeof(buf), fmt, retry);
+    }
+    va_end(retry);
+    va_end(args);
+    if (w > 0 && (size_t)w < sizeof(buf) - n)
+      n += w;
+  }
+
+  void histogram(const char *name, const char *labels, const LatencyHistogram &h)
   {
-    if (nowMs - lastCheck >= MQTT_CHECK_INTERVAL_MS)
+    size_t w = formatHistogram(buf + n, sizeof(buf) - n, name, labels, h);
+    if (w == 0)
     {
-      lastCheck = nowMs;
+      flush();
+      w = formatHistogram(buf, sizeof(buf), name, labels, h);
+    }
+    n += w;
+  }
+};
 
-      bool forceAll = (nowMs - g_lastMqttHeartbeat >= MQTT_HEARTBEAT_MS);
-      bool didPublish = mqttPublishState(forceAll);
+ChunkWriter g_chunks; // only used from the web task
 
-      if (forceAll && didPublish)
+void handleMetrics()
+{
+  ChunkWriter &out = g_chunks;
+  out.n = 0;
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; version=0.0.4", "");
+
+  char labels[40];
+  out.printf("# TYPE cg3000_stage_duration_seconds histogram\n");
+  for (uint8_t i = 0; i < STAGE_COUNT; ++i)
+  {
+    snprintf(labels, sizeof(labels), "stage=\"%s\"", STAGE_NAME[i]);
+    out.histogram("cg3000_stage_duration_seconds", labels, g_stageLatency[i]);
+  }
+  out.printf("# TYPE cg3000_http_request_duration_seconds histogram\n");
+  for (uint8_t i = 0; i < ROUTE_COUNT; ++i)
+  {
+    snprintf(labels, sizeof(labels), "route=\"%s\"", ROUTE_NAME[i]);
+    out.histogram("cg3000_http_request_duration_seconds", labels, g_httpLatency[i]);
+  }
+  out.printf("# TYPE cg3000_mqtt_message_duration_seconds histogram\n");
+  out.histogram("cg3000_mqtt_message_duration_seconds", "handler=\"onMqttMessage\"", g_mqttMessageLatency);
+
+  out.printf("# TYPE cg3000_mqtt_publishes_total counter\n");
+  for (uint8_t i = 0; i < TOPIC_COUNT; ++i)
+  {
+    out.printf("cg3000_mqtt_publishes_total{topic=\"%s\"} %lu\n", TOPIC_SUFFIX[i] + 1,
+               (unsigned long)g_mqttPub.publishCount[i]);
+  }
+
+  out.printf("# TYPE cg3000_mqtt_connect_attempts_total counter\ncg3000_mqtt_connect_attempts_total %lu\n",
+             (unsigned long)g_mqttConnectAttempts);
+  out.printf("# TYPE cg3000_mqtt_connects_total counter\ncg3000_mqtt_connects_total %lu\n",
+             (unsigned long)g_mqttConnects);
+  out.printf("# TYPE cg3000_mqtt_disconnects_total counter\ncg3000_mqtt_disconnects_total %lu\n",
+             (unsigned long)g_mqttDisconnects);
+  out.printf("# TYPE cg3000_mqtt_connected gauge\ncg3000_mqtt_connected %d\n", mqttClient.connected() ? 1 : 0);
+  out.printf("# TYPE cg3000_discovery_published_total counter\ncg3000_discovery_published_total %lu\n",
+             (unsigned long)g_discovery.published);
+  out.printf("# TYPE cg3000_discovery_current_total counter\ncg3000_discovery_current_total %lu\n",
+             (unsigned long)g_discovery.current);
+  out.printf("# TYPE cg3000_dns_attempts_total counter\ncg3000_dns_attempts_total %lu\n",
+             (unsigned long)g_dnsAttempts);
+  out.printf("# TYPE cg3000_dns_failures_total counter\ncg3000_dns_failures_total %lu\n",
+             (unsigned long)g_dnsFailures);
+  out.printf("# TYPE cg3000_dns_backoff_seconds gauge\ncg3000_dns_backoff_seconds %.3f\n", g_dnsBackoffMs / 1000.0);
+  out.printf("# TYPE cg3000_tuning_transitions_total counter\n");
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+    out.printf("cg3000_tuning_transitions_total{channel=\"%u\"} %lu\n", ch + 1,
+               (unsigned long)tuningSnapshot(ch).transitions);
+  out.printf("# TYPE cg3000_reset_pulses_total counter\n");
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+    out.printf("cg3000_reset_pulses_total{channel=\"%u\"} %lu\n", ch + 1, (unsigned long)resetPulseSnapshot(ch).count);
+  out.printf("# TYPE cg3000_reset_pulses_rejected_total counter\n");
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+    out.printf("cg3000_reset_pulses_rejected_total{channel=\"%u\"} %lu\n", ch + 1,
+               (unsigned long)resetPulseSnapshot(ch).rejected);
+  out.printf("# TYPE cg3000_commands_dropped_total counter\ncg3000_commands_dropped_total %lu\n",
+             (unsigned long)g_cmdQueue.dropped.load());
+  out.printf("# TYPE cg3000_command_duration_seconds histogram\n");
+  out.histogram("cg3000_command_duration_seconds", "phase=\"relay\"", g_commandRelayLatency);
+  out.histogram("cg3000_command_duration_seconds", "phase=\"ack\"", g_commandAckLatency);
+  out.printf("# TYPE cg3000_command_traced_total counter\ncg3000_command_traced_total %lu\n",
+             (unsigned long)g_trace.traced);
+  out.printf("# TYPE cg3000_command_duplicates_total counter\ncg3000_command_duplicates_total %lu\n",
+             (unsigned long)g_trace.duplicates);
+  out.printf("# TYPE cg3000_command_trace_overflow_total counter\ncg3000_command_trace_overflow_total %lu\n",
+             (unsigned long)g_trace.overflow);
+  out.printf("# TYPE cg3000_command_acks_total counter\n");
+  for (uint8_t i = TRACE_OK; i < TRACE_RESULT_COUNT; ++i)
+    out.printf("cg3000_command_acks_total{result=\"%s\"} %lu\n", TRACE_RESULT_NAME[i], (unsigned long)g_trace.acks[i]);
+  out.printf("# TYPE cg3000_command_queue_depth gauge\ncg3000_command_queue_depth %lu\n",
+             (unsigned long)commandQueueDepth(g_cmdQueue));
+
+  uint32_t uptimeMs = millis() - g_bootMillis;
+  out.printf("# TYPE cg3000_control_wakes_total counter\n");
+  for (uint8_t i = 0; i < WAKE_COUNT; ++i)
+    out.printf("cg3000_control_wakes_total{reason=\"%s\"} %lu\n", WAKE_NAME[i], (unsigned long)g_wakeCount[i]);
+  out.printf("# TYPE cg3000_control_idle_seconds_total counter\ncg3000_control_idle_seconds_total %.3f\n",
+             g_controlIdleMs / 1000.0);
+  out.printf("# TYPE cg3000_control_idle_percent gauge\ncg3000_control_idle_percent %.1f\n",
+             uptimeMs ? 100.0 * g_controlIdleMs / uptimeMs : 0.0);
+  out.printf("# TYPE cg3000_light_sleep_enabled gauge\ncg3000_light_sleep_enabled %d\n", g_lightSleep ? 1 : 0);
+
+  out.printf("# TYPE cg3000_journal_writes_total counter\ncg3000_journal_writes_total %lu\n",
+             (unsigned long)g_journal.flushes);
+  out.printf("# TYPE cg3000_journal_compactions_total counter\ncg3000_journal_compactions_total %lu\n",
+             (unsigned long)g_journal.compactions);
+  out.printf("# TYPE cg3000_journal_errors_total counter\ncg3000_journal_errors_total %lu\n",
+             (unsigned long)g_journal.errors);
+
+  out.printf("# TYPE cg3000_rule_actions_total counter\n");
+  for (uint8_t i = 0; i < RULE_COUNT; ++i)
+    out.printf("cg3000_rule_actions_total{rule=\"%s\"} %lu\n", RULE_NAME[i], (unsigned long)g_rules.actions[i]);
+  out.printf("# TYPE cg3000_rule_timers_armed gauge\ncg3000_rule_timers_armed %u\n", g_rules.wheel.armedCount);
+
+  out.printf("# TYPE cg3000_log_lines_total counter\ncg3000_log_lines_total %lu\n",
+             (unsigned long)g_log.next.load());
+  out.printf("# TYPE cg3000_log_suppressed_total counter\ncg3000_log_suppressed_total %lu\n",
+             (unsigned long)g_log.suppressed.load());
+  out.printf("# TYPE cg3000_log_uart_dropped_total counter\ncg3000_log_uart_dropped_total %lu\n",
+             (unsigned long)g_logUartDropped);
+
+  out.printf("# TYPE cg3000_ota_updates_total counter\n");
+  out.printf("cg3000_ota_updates_total{result=\"verified\"} %lu\n", (unsigned long)g_otaVerified);
+  out.printf("cg3000_ota_updates_total{result=\"failed\"} %lu\n", (unsigned long)g_otaFailed);
+  out.printf("# TYPE cg3000_ota_bytes gauge\ncg3000_ota_bytes %lu\n", (unsigned long)g_ota.received);
+  out.printf("# TYPE cg3000_ota_duration_seconds gauge\ncg3000_ota_duration_seconds %.3f\n",
+             otaElapsedMs(g_ota, millis()) / 1000.0);
+  out.printf("# TYPE cg3000_ota_flash_write_seconds gauge\ncg3000_ota_flash_write_seconds %.3f\n",
+             g_otaSlot.writeUs / 1e6);
+  out.printf("# TYPE cg3000_ota_throughput_bytes_per_second gauge\ncg3000_ota_throughput_bytes_per_second %lu\n",
+             (unsigned long)otaBytesPerSec(g_ota, millis()));
+
+#if CG3000_BEACON
+  out.printf("# TYPE cg3000_beacons_sent_total counter\ncg3000_beacons_sent_total %lu\n",
+             (unsigned long)g_beaconsSent);
+  out.printf("# TYPE cg3000_beacon_replies_total counter\ncg3000_beacon_replies_total %lu\n",
+             (unsigned long)g_beaconReplies.load());
+#endif
+
+  out.printf("# TYPE cg3000_stalls_total counter\n");
+  for (uint8_t i = 0; i < STAGE_COUNT; ++i)
+    out.printf("cg3000_stalls_total{stage=\"%s\"} %lu\n", STAGE_NAME[i], (unsigned long)g_stallCount[i]);
+  out.printf("# TYPE cg3000_reset_reason gauge\ncg3000_reset_reason{reason=\"%s\"} 1\n", g_resetReason);
+
+  out.printf("# TYPE cg3000_heap_free_bytes gauge\ncg3000_heap_free_bytes %lu\n", (unsigned long)ESP.getFreeHeap());
+  out.printf("# TYPE cg3000_heap_min_free_bytes gauge\ncg3000_heap_min_free_bytes %lu\n",
+             (unsigned long)ESP.getMinFreeHeap());
+  out.printf("# TYPE cg3000_heap_largest_free_block_bytes gauge\ncg3000_heap_largest_free_block_bytes %lu\n",
+             (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  out.printf("# TYPE cg3000_task_stack_free_min_bytes gauge\n");
+  TaskHandle_t tasks[] = {g_loopTask, g_webTask, g_resolveTask, g_otaTask};
+  const char *taskNames[] = {"loop", "web", "resolve", "ota"};
+  for (uint8_t i = 0; i < 4; ++i)
+  {
+    if (tasks[i])
+      out.printf("cg3000_task_stack_free_min_bytes{task=\"%s\"} %lu\n", taskNames[i],
+                 (unsigned long)uxTaskGetStackHighWaterMark(tasks[i]));
+  }
+  out.printf("# TYPE cg3000_uptime_seconds counter\ncg3000_uptime_seconds %lu\n", (unsigned long)(uptimeMs / 1000UL));
+
+  out.flush();
+  server.sendContent("");
+}
+
+// GET /history?since=<seq>&limit=<n>: events from since (or the oldest one
+// still kept) in order; the next page starts at the returned "next".
+const uint32_t HISTORY_PAGE_DEFAULT = 32;
+
+void handleHistory()
+{
+  uint32_t since = server.hasArg("since") ? strtoul(server.arg("since").c_str(), nullptr, 10) : 0;
+  uint32_t limit = server.hasArg("limit") ? server.arg("limit").toInt() : HISTORY_PAGE_DEFAULT;
+  limit = constrain(limit, (uint32_t)1, HISTORY_SIZE);
+
+  portENTER_CRITICAL(&g_historyMux);
+  uint32_t seq = max(since, historyOldest(g_history));
+  uint32_t latest = g_history.next;
+  portEXIT_CRITICAL(&g_historyMux);
+  uint32_t end = min(latest, seq + limit);
+
+  ChunkWriter &out = g_chunks;
+  out.n = 0;
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+
+  StatusSnapshot st = statusSnapshot();
+  out.printf("{\"tune\":[");
+  for (uint8_t ch = 0; ch < st.channels; ++ch)
+  {
+    const TuneStats &tune = st.tune[ch];
+    out.printf("%s{\"count\":%lu,\"minMs\":%lu,\"avgMs\":%lu,\"maxMs\":%lu,\"p50Ms\":%lu,\"p90Ms\":%lu}",
+               ch ? "," : "", (unsigned long)tune.count, (unsigned long)tune.minMs, (unsigned long)tune.avgMs,
+               (unsigned long)tune.maxMs, (unsigned long)tune.p50Ms, (unsigned long)tune.p90Ms);
+  }
+  out.printf("],\"events\":[");
+  HistoryEvent batch[HISTORY_COPY_BATCH];
+  bool first = true;
+  uint8_t n;
+  while ((n = historyCopy(seq, end, batch)) > 0)
+  {
+    char buf[128];
+    for (uint8_t i = 0; i < n; ++i)
+    {
+      formatHistoryEvent(batch[i], buf, sizeof(buf));
+      out.printf("%s%s", first ? "" : ",", buf);
+      first = false;
+    }
+  }
+  out.printf("],\"next\":%lu,\"latest\":%lu}", (unsigned long)seq, (unsigned long)latest);
+  out.flush();
+  server.sendContent("");
+}
+
+// GET /ack?id=<id>: the trace of one command (result "pending" until loop()
+// handled it); without id every command still in the trace table.
+void handleAck()
+{
+  char buf[256];
+  String id = server.arg("id");
+  if (id.length())
+  {
+    TraceEntry e;
+    portENTER_CRITICAL(&g_traceMux);
+    const TraceEntry *found = traceFind(g_trace, id.c_str(), id.length());
+    if (found)
+      e = *found;
+    portEXIT_CRITICAL(&g_traceMux);
+    if (!found)
+    {
+      server.send(404, "text/plain", "Unknown id");
+      return;
+    }
+    server.send_P(200, "application/json", buf, formatTraceAck(e, buf, sizeof(buf)));
+    return;
+  }
+
+  ChunkWriter &out = g_chunks;
+  out.n = 0;
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  out.printf("{\"acks\":[");
+  bool first = true;
+  for (uint8_t slot = 0; slot < TRACE_SLOTS; ++slot)
+  {
+    portENTER_CRITICAL(&g_traceMux);
+    TraceEntry e = g_trace.entries[slot];
+    portEXIT_CRITICAL(&g_traceMux);
+    if (!e.id[0] || formatTraceAck(e, buf, sizeof(buf)) == 0)
+      continue;
+    if (sizeof(out.buf) - out.n < sizeof(buf))
+      out.flush();
+    out.printf("%s%s", first ? "" : ",", buf);
+    first = false;
+  }
+  out.printf("]}");
+  out.flush();
+  server.sendContent("");
+}
+
+// GET /stalls: the stall, hang and crash records kept across resets, oldest
+// first, with the reason of the last reset.
+void handleStalls()
+{
+  char buf[512];
+  ChunkWriter &out = g_chunks;
+  out.n = 0;
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  out.printf("{\"boots\":%lu,\"resetReason\":\"%s\",\"records\":[", (unsigned long)g_stallLog.boots,
+             g_resetReason);
+  StallRecord rec;
+  uint32_t seq = 0;
+  bool first = true;
+  for (;;)
+  {
+    portENTER_CRITICAL(&g_stallMux);
+    bool found = stallLogNext(g_stallLog, seq, rec);
+    portEXIT_CRITICAL(&g_stallMux);
+    if (!found)
+      break;
+    seq = rec.seq;
+    if (!stallRecordValid(rec) || formatStallRecord(rec, buf, sizeof(buf)) == 0)
+      continue;
+    if (sizeof(out.buf) - out.n < sizeof(buf))
+      out.flush();
+    out.printf("%s%s", first ? "" : ",", buf);
+    first = false;
+  }
+  out.printf("]}");
+  out.flush();
+  server.sendContent("");
+}
+
+// GET /log: the lines still in the ring, or from ?since=<seq>, as text
+// ("<seq> <ms> <LEVEL> <text>"); X-Log-Next is the seq to continue from.
+// ?level=warn skips lower levels, ?follow=1 keeps streaming new lines.
+LogLevel logLevelArg()
+{
+  String level = server.arg("level");
+  for (uint8_t i = 0; i < LOG_LEVEL_COUNT; ++i)
+  {
+    if (level.equalsIgnoreCase(LOG_LEVEL_NAME[i]))
+      return (LogLevel)i;
+  }
+  return LOG_DEBUG;
+}
+
+void handleLog()
+{
+  uint32_t oldest = logOldest(g_log);
+  uint32_t next = g_log.next.load(std::memory_order_acquire);
+  uint32_t since = server.hasArg("since") ? strtoul(server.arg("since").c_str(), nullptr, 10) : oldest;
+  since = max(since, oldest);
+  LogLevel minLevel = logLevelArg();
+
+  if (server.hasArg("follow"))
+  {
+    int slot = -1;
+    for (uint8_t i = 0; i < LOG_MAX_FOLLOWERS; ++i)
+    {
+      if (!g_logFollowers[i].connected())
       {
-        g_lastMqttHeartbeat = nowMs;
+        slot = i;
+        break;
       }
     }
+    if (slot < 0)
+    {
+      server.send(503, "text/plain", "Too many log followers");
+      return;
+    }
+    WiFiClient client = server.client();
+    static const char HEADERS[] = "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: text/plain; charset=utf-8\r\n"
+                                  "Cache-Control: no-cache\r\n"
+                                  "Connection: close\r\n\r\n";
+    if (streamSend(client, HEADERS, sizeof(HEADERS) - 1) != (int)sizeof(HEADERS) - 1)
+    {
+      client.stop();
+      return;
+    }
+    g_logFollowSeq[slot] = since;
+    g_logFollowLevel[slot] = minLevel;
+    g_logFollowers[slot] = client;
+    return;
+  }
+
+  ChunkWriter &out = g_chunks;
+  out.n = 0;
+  server.sendHeader("X-Log-Next", String(next));
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "text/plain; charset=utf-8", "");
+  char buf[LOG_TEXT_MAX + 32];
+  for (uint32_t seq = since; seq < next; ++seq)
+  {
+    LogLine line;
+    if (!logRead(g_log, seq, line) || line.level < minLevel)
+      continue;
+    formatLogLine(line, buf, sizeof(buf));
+    out.printf("%s", buf);
+  }
+  out.flush();
+  server.sendContent("");
+}
+
+// GET /rules: the rule settings per channel and how often each rule acted
+// (no_reset_tuning: resets refused).
+void handleRules()
+{
+  StatusSnapshot st = statusSnapshot();
+  ChunkWriter &out = g_chunks;
+  out.n = 0;
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  out.printf("{\"channels\":[");
+  for (uint8_t ch = 0; ch < st.channels; ++ch)
+  {
+    const RuleConfig &rules = st.rules[ch];
+    out.printf("%s{\"idle_off\":%u,\"tune_timeout\":%u,\"no_reset_tuning\":%s}", ch ? "," : "",
+               rules.value[RULE_IDLE_OFF], rules.value[RULE_TUNE_TIMEOUT],
+               rules.value[RULE_NO_RESET_TUNING] ? "true" : "false");
+  }
+  out.printf("],\"actions\":{");
+  for (uint8_t i = 0; i < RULE_COUNT; ++i)
+    out.printf("%s\"%s\":%lu", i ? "," : "", RULE_NAME[i], (unsigned long)g_rules.actions[i]);
+  out.printf("},\"timersArmed\":%u}", g_rules.wheel.armedCount);
+  out.flush();
+  server.sendContent("");
+}
+
+// POST /rules?ch=<n>&idle_off=<s>&tune_timeout=<s>&no_reset_tuning=ON|OFF
+// changes the given rules of channel n (default 1); the values are checked
+// with the MQTT payload codecs and applied by loop() as commands.
+void handleRulesSet()
+{
+  static bool (*const parse[RULE_COUNT])(const char *, size_t, Command &) = {
+      parseIdleOffSet, parseTuneTimeoutSet, parseNoResetTuningSet};
+  long ch = server.hasArg("ch") ? server.arg("ch").toInt() - 1 : 0;
+  if (ch < 0 || ch >= CHANNEL_COUNT)
+  {
+    server.send(400, "text/plain", "Unknown channel");
+    return;
+  }
+  Command cmds[RULE_COUNT];
+  uint8_t n = 0;
+  for (uint8_t rule = 0; rule < RULE_COUNT; ++rule)
+  {
+    if (!server.hasArg(RULE_NAME[rule]))
+      continue;
+    String value = server.arg(RULE_NAME[rule]);
+    if (!parse[rule](value.c_str(), value.length(), cmds[n]))
+    {
+      server.send(400, "text/plain", String("Bad value for ") + RULE_NAME[rule]);
+      return;
+    }
+    cmds[n++].channel = (uint8_t)ch;
+  }
+  for (uint8_t i = 0; i < n; ++i)
+  {
+    if (!commandPush(cmds[i].type, cmds[i].channel, cmds[i].arg))
+    {
+      server.send(503, "text/plain", "Command queue full");
+      return;
+    }
+  }
+  server.sendHeader("Location", "/rules");
+  server.send(303);
+}
+
+// Records the handler latency and when the first HTTP response after
+// power-on went out.
+WebServer::THandlerFunction timed(HttpRoute route, WebServer::THandlerFunction handler)
+{
+  return [route, handler]()
+  {
+    uint32_t startUs = micros();
+    handler();
+    observeSince(g_httpLatency[route], startUs);
+    if (g_bootTtfbMs.load(std::memory_order_relaxed) != 0)
+      return;
+    g_bootTtfbMs = millis();
+    LOG(LOG_INFO, "First HTTP response %lu ms after power-on", (unsigned long)g_bootTtfbMs.load());
+  };
+}
+
+// Firmware updates: POST /update on a second HTTP server (OTA_HTTP_PORT) with
+// its own task, so the page and relay control stay served while an image is
+// streamed. Uploads need user OTA_USER with the password built in as
+// CG3000_OTA_PASSWORD (digest or basic auth); without one the server is not
+// started.
+#ifndef CG3000_OTA_PASSWORD
+#define CG3000_OTA_PASSWORD ""
+#endif
+
+const char *OTA_USER = "cg3000";
+const uint16_t OTA_HTTP_PORT = 8080;
+const uint32_t OTA_TASK_STACK = 4096;
+const uint32_t OTA_IDLE_POLL_MS = 50;
+
+WebServer g_otaServer(OTA_HTTP_PORT);
+bool g_otaStarted = false; // the current request carried an image
+
+// A new image runs on trial: it has to come up healthy (see otaHealthy)
+// within OTA_TRIAL_MS and may reset at most OTA_TRIAL_BOOTS times before
+// that, otherwise the previous image is made the boot partition again.
+// Reaching the broker is only part of the check with
+// CG3000_OTA_REQUIRE_BROKER, so a broker outage does not roll back a
+// working image.
+#ifndef CG3000_OTA_REQUIRE_BROKER
+#define CG3000_OTA_REQUIRE_BROKER 0
+#endif
+
+const uint32_t OTA_TRIAL_MS = 180000;
+const uint8_t OTA_TRIAL_BOOTS = 3;
+const char *PREF_OTA_PREVIOUS = "otaPrev";     // label of the image to return to while on trial
+const char *PREF_OTA_BOOTS = "otaBoots";       // trial boots so far
+const char *PREF_OTA_ROLLBACK = "otaRollback"; // why the last rollback happened, for the next boot
+esp_timer_handle_t g_otaTrialTimer = nullptr;
+
+void otaRollback(const char *reason)
+{
+  String previous = g_prefs.getString(PREF_OTA_PREVIOUS, "");
+  g_prefs.remove(PREF_OTA_PREVIOUS);
+  g_prefs.remove(PREF_OTA_BOOTS);
+  const esp_partition_t *partition =
+      esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, previous.c_str());
+  if (!partition || esp_ota_set_boot_partition(partition) != ESP_OK)
+  {
+    LOG(LOG_ERROR, "Update rollback to %s failed, keeping this image", previous.c_str());
+    return;
+  }
+  g_prefs.putString(PREF_OTA_ROLLBACK, reason);
+  esp_restart();
+}
+
+void onOtaTrialExpired(void *)
+{
+  otaRollback("not online within the trial period");
+}
+
+// Called from setup(): counts the trial boots and arms the deadline.
+void otaBootCheck()
+{
+  g_otaRollback = g_prefs.getString(PREF_OTA_ROLLBACK, "");
+  if (g_otaRollback.length() > 0)
+  {
+    g_prefs.remove(PREF_OTA_ROLLBACK);
+    LOG(LOG_WARN, "Update rolled back: %s", g_otaRollback.c_str());
+  }
+  if (!g_prefs.isKey(PREF_OTA_PREVIOUS))
+    return;
+  uint8_t boots = g_prefs.getUChar(PREF_OTA_BOOTS, 0) + 1;
+  if (boots > OTA_TRIAL_BOOTS)
+  {
+    otaRollback("reset during every trial boot");
+    return;
+  }
+  g_prefs.putUChar(PREF_OTA_BOOTS, boots);
+  g_otaTrial = true;
+  esp_timer_create_args_t args = {};
+  args.callback = onOtaTrialExpired;
+  args.name = "ota_trial";
+  esp_timer_create(&args, &g_otaTrialTimer);
+  esp_timer_start_once(g_otaTrialTimer, OTA_TRIAL_MS * 1000ULL);
+  LOG(LOG_INFO, "Running %s on trial (boot %u of %u)", esp_ota_get_running_partition()->label, boots,
+      OTA_TRIAL_BOOTS);
+}
+
+void otaConfirm()
+{
+  esp_timer_stop(g_otaTrialTimer);
+  g_prefs.remove(PREF_OTA_PREVIOUS);
+  g_prefs.remove(PREF_OTA_BOOTS);
+  esp_ota_mark_app_valid_cancel_rollback(); // in case the bootloader does its own rollback
+  g_otaTrial = false;
+  LOG(LOG_INFO, "Update confirmed %lu ms after boot", (unsigned long)(millis() - g_bootMillis));
+}
+
+// Upload callback of POST /update, called per received piece of the file
+// (HTTP_UPLOAD_BUFLEN bytes); otaWrite collects them into flash sectors.
+void handleUpdateUpload()
+{
+  HTTPUpload &upload = g_otaServer.upload();
+  uint32_t nowMs = millis();
+  switch (upload.status)
+  {
+  case UPLOAD_FILE_START:
+    if (!g_otaServer.authenticate(OTA_USER, CG3000_OTA_PASSWORD) || g_otaTrial)
+      return;
+    g_otaStarted = true;
+    if (otaBegin(g_ota, g_otaSlot, g_otaServer.arg("sha256").c_str(), nowMs))
+      LOG(LOG_INFO, "Update started, writing %s", g_otaSlot.partition()->label);
+    break;
+  case UPLOAD_FILE_WRITE:
+    if (g_otaStarted)
+      otaWrite(g_ota, g_otaSlot, upload.buf, upload.currentSize, nowMs);
+    break;
+  case UPLOAD_FILE_END:
+    if (g_otaStarted)
+      otaFinish(g_ota, g_otaSlot, nowMs);
+    break;
+  case UPLOAD_FILE_ABORTED:
+    if (g_otaStarted)
+      otaAbort(g_ota, g_otaSlot, "upload aborted", nowMs);
+    break;
+  }
+}
+
+void handleUpdate()
+{
+  bool started = g_otaStarted;
+  g_otaStarted = false;
+  if (!g_otaServer.authenticate(OTA_USER, CG3000_OTA_PASSWORD))
+  {
+    g_otaServer.requestAuthentication(DIGEST_AUTH, "cg3000");
+    return;
+  }
+  if (g_otaTrial)
+  {
+    g_otaServer.send(409, "text/plain", "Running image is still on trial");
+    return;
+  }
+  if (!started)
+  {
+    g_otaServer.send(400, "text/plain", "No firmware file in request");
+    return;
+  }
+
+  uint32_t nowMs = millis();
+  if (g_ota.state == OTA_RECEIVING)
+    otaAbort(g_ota, g_otaSlot, "upload incomplete", nowMs);
+  char msg[160];
+  snprintf(msg, sizeof(msg), "%lu bytes in %lu ms (%lu KB/s, flash %lu ms)", (unsigned long)g_ota.received,
+           (unsigned long)otaElapsedMs(g_ota, nowMs), (unsigned long)(otaBytesPerSec(g_ota, nowMs) / 1024),
+           (unsigned long)(g_otaSlot.writeUs / 1000));
+  if (g_ota.state != OTA_VERIFIED)
+  {
+    g_otaFailed++;
+    LOG(LOG_WARN, "Update failed: %s after %s", g_ota.error, msg);
+    g_otaServer.send(422, "text/plain", String("Update failed: ") + g_ota.error + "\n");
+    return;
+  }
+
+  // Marks the running image as the one to return to while the new one is on trial.
+  g_prefs.putString(PREF_OTA_PREVIOUS, esp_ota_get_running_partition()->label);
+  g_prefs.putUChar(PREF_OTA_BOOTS, 0);
+  g_otaVerified++;
+  LOG(LOG_INFO, "Update verified: %s", msg);
+  g_otaServer.send(200, "text/plain", String("Update verified: ") + msg + ", restarting\n");
+  shouldRestart = true;
+  controlWake(WAKE_COMMAND);
+}
+
+void otaTask(void *)
+{
+  for (;;)
+  {
+    g_otaServer.handleClient();
+    if (g_otaServer.client().connected())
+      vTaskDelay(1);
+    else
+      vTaskDelay(pdMS_TO_TICKS(OTA_IDLE_POLL_MS));
+  }
+}
+
+void startOtaServer()
+{
+  if (strlen(CG3000_OTA_PASSWORD) == 0)
+  {
+    LOG(LOG_INFO, "OTA disabled (no CG3000_OTA_PASSWORD)");
+    return;
+  }
+  g_otaServer.on("/update", HTTP_POST, handleUpdate, handleUpdateUpload);
+  g_otaServer.begin();
+  xTaskCreatePinnedToCore(otaTask, "ota", OTA_TASK_STACK, nullptr, WEB_TASK_PRIORITY, &g_otaTask, WEB_TASK_CORE);
+}
+
+void saveConfigCallback()
+{
+  LOG(LOG_INFO, "New WiFi config saved, please restart...");
+  shouldRestart = true;
+}
+
+// Startup runs as a state machine from loop(): relays and GPIO are set in
+// setup(), Wi-Fi connects in the background, HTTP, mDNS and MQTT start as
+// soon as there is an IP, and NTP completes whenever it arrives.
+enum BootState : uint8_t
+{
+  BOOT_WIFI_CONNECTING,
+  BOOT_PORTAL,
+  BOOT_ONLINE,
+};
+
+const unsigned long WIFI_CONNECT_TIMEOUT_MS = 20000UL;
+
+BootState g_bootState = BOOT_WIFI_CONNECTING;
+unsigned long g_wifiStartMs = 0;
+
+// Checked from loop(), so the control loop runs; Wi-Fi has to be up and
+// the web task polling the server without a stall.
+bool otaHealthy()
+{
+  const StallWatch &web = g_watch[WATCH_WEB];
+  bool webServing = (web.state.load() >> 8) != 0 && web.recordSeq == 0;
+  bool healthy = g_bootState == BOOT_ONLINE && WiFi.status() == WL_CONNECTED && webServing;
+#if CG3000_OTA_REQUIRE_BROKER
+  healthy = healthy && mqttClient.connected();
+#endif
+  return healthy;
+}
+
+void startWifi()
+{
+  WiFi.mode(WIFI_STA);
+  WiFi.setHostname("CG3000-ESP32");
+  WiFi.begin(); // credentials stored by WiFiManager
+  g_wifiStartMs = millis();
+  g_bootState = BOOT_WIFI_CONNECTING;
+}
+
+void startPortal()
+{
+  LOG(LOG_INFO, "AP-Modus active.");
+  wm.startConfigPortal("CG3000-Setup", "tuner1234"); // non-blocking, served by bootLoop()
+  g_bootState = BOOT_PORTAL;
+}
+
+void startNetworkServices()
+{
+  g_bootIpMs = millis();
+  LOG(LOG_INFO, "WiFi connected after %lu ms.", (unsigned long)g_bootIpMs);
+
+  configTzTime("CET-1CEST,M3.5.0/2,M10.5.0/3", "pool.ntp.org", "time.nist.gov");
+
+  if (!MDNS.begin("cg3000-esp32"))
+  {
+    // still silent to avoid spam
+  }
+  setupMqttResolver();
+
+  server.begin();
+  xTaskCreatePinnedToCore(webTask, "web", WEB_TASK_STACK, nullptr, WEB_TASK_PRIORITY, &g_webTask, WEB_TASK_CORE);
+  startOtaServer();
+#if CG3000_BEACON
+  startBeacon();
+#endif
+  g_bootState = BOOT_ONLINE;
+}
+
+void bootLoop()
+{
+  switch (g_bootState)
+  {
+  case BOOT_WIFI_CONNECTING:
+    if (WiFi.status() == WL_CONNECTED)
+      startNetworkServices();
+    else if (millis() - g_wifiStartMs >= WIFI_CONNECT_TIMEOUT_MS)
+      startPortal();
+    break;
+
+  case BOOT_PORTAL:
+    wm.process();
+    if (!wm.getConfigPortalActive())
+    {
+      if (WiFi.status() == WL_CONNECTED)
+        startNetworkServices();
+      else
+        startWifi(); // portal timed out, keep trying the stored network
+    }
+    break;
+
+  case BOOT_ONLINE:
+    if (g_bootTimeMs == 0 && isTimeValid())
+    {
+      g_bootTimeMs = millis();
+      LOG(LOG_INFO, "Time valid after %lu ms.", (unsigned long)g_bootTimeMs);
+    }
+    break;
+  }
+}
+
+// Blocks loop() until a wake bit is set or the next deadline is due.
+const uint32_t CONTROL_TICK_MS = 1000; // status time fields change once per second
+const uint32_t PORTAL_POLL_MS = 10;    // WiFiManager's DNS and web server are polled
+
+uint32_t controlTimeoutMs()
+{
+  unsigned long nowMs = millis();
+  uint32_t timeout = CONTROL_TICK_MS - (nowMs - g_bootMillis) % CONTROL_TICK_MS;
+  if (g_bootState == BOOT_PORTAL)
+    timeout = min(timeout, PORTAL_POLL_MS);
+  if (g_discoveryPending)
+  {
+    int32_t due = (int32_t)(g_discoveryDueMs - nowMs);
+    timeout = min(timeout, due > 0 ? (uint32_t)due : (uint32_t)0);
+  }
+  timeout = min(timeout, rulesNextDueMs(g_rules, nowMs));
+  if (g_mqttPub.changePending)
+  {
+    uint32_t waited = nowMs - g_mqttPub.changeSinceMs;
+    timeout = min(timeout, waited < MQTT_COALESCE_MS ? MQTT_COALESCE_MS - waited : (uint32_t)0);
+  }
+  return timeout;
+}
+
+void controlWait()
+{
+  uint32_t bits = 0;
+  uint32_t startUs = micros();
+  xTaskNotifyWait(0, UINT32_MAX, &bits, pdMS_TO_TICKS(controlTimeoutMs()));
+  g_controlIdleUs += micros() - startUs;
+  g_controlIdleMs = (uint32_t)(g_controlIdleUs / 1000);
+  if (bits == 0)
+    g_wakeCount[WAKE_TIMER]++;
+  for (uint8_t i = WAKE_TIMER + 1; i < WAKE_COUNT; ++i)
+  {
+    if (bits & (1UL << i))
+      g_wakeCount[i]++;
+  }
+}
+
+void setupPowerSave()
+{
+#if CG3000_POWER_SAVE
+  esp_pm_config_esp32_t pm = {};
+  pm.max_freq_mhz = 240;
+  pm.min_freq_mhz = 80; // lowest clock that keeps Wi-Fi running
+  pm.light_sleep_enable = true;
+  esp_err_t err = esp_pm_configure(&pm);
+  if (err == ESP_ERR_NOT_SUPPORTED)
+  {
+    pm.light_sleep_enable = false; // SDK without tickless idle: DFS only
+    err = esp_pm_configure(&pm);
+  }
+  g_lightSleep = err == ESP_OK && pm.light_sleep_enable;
+  LOG(LOG_INFO, "Power save: %s", err != ESP_OK ? "not available" : g_lightSleep ? "DFS + light sleep" : "DFS");
+#endif
+}
+
+void WiFiEvent(WiFiEvent_t event)
+{
+  controlWake(WAKE_NETWORK);
+  if (event == WIFI_EVENT_STA_DISCONNECTED)
+  {
+    g_brokerLost = true;
+  }
+  if (event == IP_EVENT_STA_GOT_IP)
+  {
+    requestMqttResolve();
+  }
+}
+
+void setup()
+{
+#if CG3000_LOG_UART
+  Serial.begin(115200);
+#endif
+  g_bootMillis = millis();
+  g_loopTask = xTaskGetCurrentTaskHandle(); // setup() and loop() share the loop task
+  stallBoot();
+  g_prefs.begin(PREFS_NAMESPACE, false);
+
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+  {
+    pinMode(CHANNELS[ch].tuning, INPUT_PULLUP);
+    pinMode(CHANNELS[ch].reset, OUTPUT);
+    pinMode(CHANNELS[ch].power, OUTPUT);
+    digitalWrite(CHANNELS[ch].reset, LOW);
+  }
+  restoreState();
+  otaBootCheck();
+  rulesInit(g_rules, millis());
+  loadRules();
+
+  setupTuningInput();
+  setupResetPulse();
+  setupPowerSave();
+
+  wm.setSaveConfigCallback(saveConfigCallback);
+  wm.setDebugOutput(CG3000_LOG_UART);
+  wm.setHostname("CG3000-ESP32");
+  wm.setConnectRetries(3);
+  wm.setConnectTimeout(20);
+  wm.setConfigPortalTimeout(300);
+  wm.setConfigPortalBlocking(false);
+
+  WiFi.onEvent(WiFiEvent);
+
+  g_deviceId = "cg3000-" + chipId();
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+    buildTopics(g_mqttTopics[ch], g_deviceId.c_str(), ch);
+
+  mqttClient.onConnect(onMqttConnect);
+  mqttClient.onDisconnect(onMqttDisconnect);
+  mqttClient.onMessage(onMqttMessage);
+
+  static const char *collectedHeaders[] = {"If-None-Match"};
+  server.collectHeaders(collectedHeaders, 1);
+
+  server.on("/", timed(ROUTE_ROOT, handleRoot));
+  server.on("/status", timed(ROUTE_STATUS, handleStatus));
+  server.on("/events", HTTP_GET, timed(ROUTE_EVENTS, handleEvents));
+  for (uint8_t ch = 0; ch < CHANNEL_COUNT; ++ch)
+  {
+    // Channel 1 keeps /reset and /power, channel n gets /ch<n>/reset and /ch<n>/power.
+    String prefix = ch == 0 ? String() : "/ch" + String(ch + 1);
+    server.on(prefix + "/reset", HTTP_POST, timed(ROUTE_RESET, [ch]() { handleReset(ch); }));
+    server.on(prefix + "/power", HTTP_POST, timed(ROUTE_POWER, [ch]() { handlePower(ch); }));
+  }
+  server.on("/metrics", HTTP_GET, timed(ROUTE_METRICS, handleMetrics));
+  server.on("/history", HTTP_GET, timed(ROUTE_HISTORY, handleHistory));
+  server.on("/log", HTTP_GET, timed(ROUTE_LOG, handleLog));
+  server.on("/rules", HTTP_GET, timed(ROUTE_RULES, handleRules));
+  server.on("/rules", HTTP_POST, timed(ROUTE_RULES, handleRulesSet));
+  server.on("/ack", HTTP_GET, timed(ROUTE_ACK, handleAck));
+  server.on("/stalls", HTTP_GET, timed(ROUTE_STALLS, handleStalls));
+  server.onNotFound(timed(ROUTE_NOT_FOUND, handleNotFound));
+
+  refreshStatus();
+
+  if (wm.getWiFiIsSaved())
+    startWifi();
+  else
+    startPortal();
+}
+
+void loop()
+{
+  if (shouldRestart)
+  {
+    journalLoop(true);
+    delay(1000);
+    ESP.restart();
+  }
+
+  uint32_t loopStartUs = micros();
+  stageEnter(WATCH_LOOP, STAGE_LOOP, loopStartUs);
+  bootLoop();
+
+  uint32_t t = micros();
+  stageEnter(WATCH_LOOP, STAGE_COMMANDS, t);
+  processCommands();
+  rulesLoop();
+  t = observeSince(g_stageLatency[STAGE_COMMANDS], t);
+  stageEnter(WATCH_LOOP, STAGE_STATUS, t);
+  refreshStatus();
+  journalLoop();
+  t = observeSince(g_stageLatency[STAGE_STATUS], t);
+  stageEnter(WATCH_LOOP, STAGE_MQTT, t);
+
+  if (g_brokerLost.exchange(false))
+  {
+    // Keep trying the known address while it is re-resolved.
+    requestMqttResolve();
+  }
+
+  uint32_t resolvedIp = g_resolvedIp.exchange(0);
+  if (resolvedIp != 0)
+  {
+    g_mqttIp = resolvedIp;
+    g_mqttIpValid = true;
+  }
+
+  if (g_mqttJustConnected.exchange(false))
+  {
+    g_discoveryPending = true;
+    g_discoveryDueMs = millis() + DISCOVERY_SETTLE_MS;
+    g_mqttPub.initialDone = false;
+    mqttPublishState(true);         // alles initial senden
+    g_lastMqttHeartbeat = millis(); // Heartbeat-Timer starten
+  }
+
+  unsigned long nowMs = millis();
+  static unsigned long lastConnectAttempt = 0;
+
+  if (g_bootState == BOOT_ONLINE && g_mqttIpValid && !mqttClient.connected() &&
+      (g_mqttConnectAttempts == 0 || nowMs - lastConnectAttempt >= MQTT_CONNECT_RETRY_MS))
+  {
+    lastConnectAttempt = nowMs;
+    g_mqttConnectAttempts++;
+    mqttClient.setServer(g_mqttIp, MQTT_PORT);
+    mqttClient.connect();
+  }
+
+  if (g_otaTrial && otaHealthy())
+    otaConfirm();
+
+  if (g_discoveryPending && mqttClient.connected() && (int32_t)(nowMs - g_discoveryDueMs) >= 0)
+  {
+    g_discoveryPending = false;
+    mqttPublishDiscovery();
+  }
+
+  publishAcks();
+  if (mqttClient.connected())
+  {
+    publishStalls();
+    bool forceAll = (nowMs - g_lastMqttHeartbeat >= MQTT_HEARTBEAT_MS);
+    if (mqttPublishState(forceAll) && forceAll)
+    {
+      g_lastMqttHeartbeat = nowMs;
+    }
   }
+#if CG3000_BEACON
+  beaconLoop();
+#endif
+  t = observeSince(g_stageLatency[STAGE_MQTT], t);
+  stageEnter(WATCH_LOOP, STAGE_LOOP, t);
+  logSinks();
+  observeSince(g_stageLatency[STAGE_LOOP], loopStartUs);
+  stageExit(WATCH_LOOP);
+
+  controlWait();
 }
@@ -0,0 +1,226 @@
+// Host side of the status beacon (lib/cg3000_core/src/beacon.h): prints
+// every beacon on the multicast group as one JSON line, queries the fleet,
+// or plays a device so collectors can be tested without hardware.
+//
+// Usage: program [--group ADDR] [--port N] [--query [HOST]] [--wait MS] [--emit ID]
+//   (default)     listen on the group and print beacons until interrupted
+//   --query       send one query (to the group or HOST), print the answers
+//                 that arrive within --wait ms (default 1000), then exit
+//   --emit ID     act as device ID: heartbeat every second, answer queries
+#include <arpa/inet.h>
+#include <chrono>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "beacon.h"
+
+// Same as src/main.cpp.
+const char *BEACON_GROUP_DEFAULT = "239.255.30.0";
+const uint16_t BEACON_PORT_DEFAULT = 30000;
+
+uint32_t nowMs()
+{
+  using namespace std::chrono;
+  return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+int openSocket(const char *group, uint16_t port, bool join)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(join ? port : 0);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  if (join)
+  {
+    ip_mreq mreq = {};
+    inet_pton(AF_INET, group, &mreq.imr_multiaddr);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+      perror("IP_ADD_MEMBERSHIP");
+  }
+  return fd;
+}
+
+void printBeacon(const Beacon &b, const sockaddr_in &from)
+{
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+  printf("{\"from\":\"%s\",\"id\":\"%s\",\"seq\":%u,\"reply\":%s,\"uptime\":%u,\"mqttConnected\":%s,"
+         "\"timeValid\":%s,\"firmware\":\"",
+         ip, b.id, b.seq, b.flags & BEACON_REPLY ? "true" : "false", b.uptimeSec,
+         b.flags & BEACON_MQTT ? "true" : "false", b.flags & BEACON_TIME_VALID ? "true" : "false");
+  for (size_t i = 0; i < BEACON_FIRMWARE_SIZE; ++i)
+    printf("%02x", b.firmware[i]);
+  printf("\",\"channels\":[");
+  for (uint8_t ch = 0; ch < b.channels; ++ch)
+  {
+    printf("%s{\"power\":%s,\"tuning\":%s,\"lastReset\":%u}", ch ? "," : "", (b.power >> ch) & 1 ? "true" : "false",
+           (b.tuning >> ch) & 1 ? "true" : "false", b.lastReset[ch]);
+  }
+  printf("]}\n");
+  fflush(stdout);
+}
+
+// Prints beacons until timeoutMs passed (forever if 0); returns how many.
+unsigned receive(int fd, uint32_t timeoutMs)
+{
+  unsigned count = 0;
+  uint32_t startMs = nowMs();
+  for (;;)
+  {
+    int waitMs = -1;
+    if (timeoutMs)
+    {
+      uint32_t elapsed = nowMs() - startMs;
+      if (elapsed >= timeoutMs)
+        return count;
+      waitMs = timeoutMs - elapsed;
+    }
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, waitMs) <= 0)
+      continue;
+    uint8_t buf[512];
+    sockaddr_in from = {};
+    socklen_t fromLen = sizeof(from);
+    ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&from, &fromLen);
+    Beacon b;
+    if (n > 0 && beaconDecode(buf, n, b))
+    {
+      printBeacon(b, from);
+      count++;
+    }
+    else if (n > 0 && !beaconIsQuery(buf, n))
+      fprintf(stderr, "ignoring %zd byte datagram\n", n);
+  }
+}
+
+int query(const char *target, uint16_t port, uint32_t waitMs)
+{
+  int fd = openSocket(target, port, false);
+  if (fd < 0)
+    return 1;
+  sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_port = htons(port);
+  if (inet_pton(AF_INET, target, &to.sin_addr) != 1)
+  {
+    fprintf(stderr, "not an IPv4 address: %s\n", target);
+    return 2;
+  }
+  uint8_t buf[BEACON_QUERY_SIZE];
+  size_t n = beaconQueryEncode(buf, sizeof(buf));
+  uint32_t startMs = nowMs();
+  if (sendto(fd, buf, n, 0, (sockaddr *)&to, sizeof(to)) < 0)
+  {
+    perror("sendto");
+    return 1;
+  }
+  unsigned count = receive(fd, waitMs);
+  fprintf(stderr, "%u devices answered within %u ms\n", count, nowMs() - startMs);
+  close(fd);
+  return 0;
+}
+
+// A device with one channel whose power relay toggles every 10 s.
+int emit(const char *group, uint16_t port, const char *id)
+{
+  int fd = openSocket(group, port, true);
+  if (fd < 0)
+    return 1;
+  sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_port = htons(port);
+  inet_pton(AF_INET, group, &to.sin_addr);
+
+  Beacon b = {};
+  b.channels = 1;
+  b.flags = BEACON_MQTT;
+  memcpy(b.firmware, "\x12\x34\x56\x78\x9a\xbc\xde\xf0", BEACON_FIRMWARE_SIZE);
+  snprintf(b.id, sizeof(b.id), "%s", id);
+  uint32_t startMs = nowMs();
+  uint32_t lastSentMs = startMs - 1000;
+  uint8_t buf[BEACON_MAX];
+  for (;;)
+  {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) > 0)
+    {
+      sockaddr_in from = {};
+      socklen_t fromLen = sizeof(from);
+      ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&from, &fromLen);
+      if (n > 0 && beaconIsQuery(buf, n))
+      {
+        b.flags |= BEACON_REPLY;
+        b.seq++;
+        sendto(fd, buf, beaconEncode(b, buf, sizeof(buf)), 0, (sockaddr *)&from, fromLen);
+        b.flags &= ~BEACON_REPLY;
+      }
+    }
+    uint32_t now = nowMs();
+    b.uptimeSec = (now - startMs) / 1000;
+    b.power = (b.uptimeSec / 10) & 1;
+    if (now - lastSentMs >= 1000)
+    {
+      lastSentMs = now;
+      b.seq++;
+      sendto(fd, buf, beaconEncode(b, buf, sizeof(buf)), 0, (sockaddr *)&to, sizeof(to));
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *group = BEACON_GROUP_DEFAULT;
+  uint16_t port = BEACON_PORT_DEFAULT;
+  const char *queryTarget = nullptr;
+  const char *emitId = nullptr;
+  uint32_t waitMs = 1000;
+  for (int i = 1; i < argc; ++i)
+  {
+    bool hasValue = i + 1 < argc && argv[i + 1][0] != '-';
+    if (strcmp(argv[i], "--group") == 0 && hasValue)
+      group = argv[++i];
+    else if (strcmp(argv[i], "--port") == 0 && hasValue)
+      port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--wait") == 0 && hasValue)
+      waitMs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--emit") == 0 && hasValue)
+      emitId = argv[++i];
+    else if (strcmp(argv[i], "--query") == 0)
+      queryTarget = hasValue ? argv[++i] : "";
+    else
+    {
+      fprintf(stderr, "usage: %s [--group ADDR] [--port N] [--query [HOST]] [--wait MS] [--emit ID]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  if (emitId)
+    return emit(group, port, emitId);
+  if (queryTarget)
+    return query(queryTarget[0] ? queryTarget : group, port, waitMs);
+  int fd = openSocket(group, port, true);
+  if (fd < 0)
+    return 1;
+  receive(fd, 0);
+  return 0;
+}
@@ -0,0 +1,311 @@
+// Host benchmark of the MQTT control path: several client threads deliver
+// power/set messages the way onMqttMessage() does (route, parse, queue), one
+// thread plays loop() (drain queue, switch relay, refresh status, publish).
+// Prints one JSON object with throughput, p50/p95/p99 latency and heap
+// allocations per operation, so runs can be diffed between versions.
+// After the load phase a single client measures the power/set ->
+// power/state round trip: it sends one command and waits for the state
+// publish before the next, so every command gives one sample.
+//
+// Usage: program [--clients N] [--rate MSGS_PER_S_PER_CLIENT] [--ops N_PER_CLIENT]
+//                [--roundtrips N]
+//   --rate 0 (default) sends as fast as the queue takes it: like a QoS 1
+//   client waiting for its acks, a producer backs off while the queue is
+//   full, so the latencies are those of the steady state, not of drops.
+//   --roundtrips (default 50) takes about 100 ms each (coalescing window).
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "channels.h" // firmware channel table
+#include "control.h"
+#include "hal_native.h"
+#include "mqtt_state.h"
+#include "status.h"
+
+// Channel 1 of the firmware, so the bench follows include/channels.h.
+const uint8_t PIN_RELAY_POWER = CHANNELS[0].power;
+
+// Heap allocations are only counted inside measured sections, into the
+// counter of the operation the current thread is measuring.
+thread_local uint64_t *volatile t_allocSink = nullptr;
+
+void *operator new(size_t size)
+{
+  if (t_allocSink)
+    (*t_allocSink)++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+
+typedef std::chrono::steady_clock BenchClock;
+
+uint64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now().time_since_epoch()).count();
+}
+
+// The coalescing window runs on real time here, so round trips include it.
+class SteadyClock : public HalClock
+{
+public:
+  uint32_t millis() override { return (uint32_t)(nowNs() / 1000000ULL); }
+  time_t now() override { return time(nullptr); }
+};
+
+// Broker stand-in that only timestamps power/state publishes (no allocation).
+class BenchBroker : public HalMqtt
+{
+public:
+  explicit BenchBroker(const MqttTopics &topics) : _topics(topics) {}
+  bool connected() override { return true; }
+  void publish(const char *topic, const char *, bool) override
+  {
+    publishes++;
+    if (topic == _topics.topics[TOPIC_POWER_STATE])
+      lastPowerPublishNs = nowNs();
+  }
+
+  uint64_t publishes = 0;
+  uint64_t lastPowerPublishNs = 0;
+
+private:
+  const MqttTopics &_topics;
+};
+
+struct OpStats
+{
+  explicit OpStats(const char *opName = "") : name(opName) {}
+
+  const char *name;
+  std::vector<uint32_t> latencyNs;
+  uint64_t allocs = 0;
+  uint64_t wallNs = 0;
+
+  void reserve(size_t n) { latencyNs.reserve(n); }
+};
+
+uint32_t percentile(std::vector<uint32_t> &sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+  return sorted[i];
+}
+
+void printOp(OpStats &op, bool last)
+{
+  std::sort(op.latencyNs.begin(), op.latencyNs.end());
+  size_t n = op.latencyNs.size();
+  double seconds = op.wallNs / 1e9;
+  printf("    \"%s\": {\"ops\": %zu, \"throughput_per_s\": %.1f, \"p50_us\": %.3f, \"p95_us\": %.3f, "
+         "\"p99_us\": %.3f, \"allocs_per_op\": %.3f}%s\n",
+         op.name, n, seconds > 0 ? n / seconds : 0.0, percentile(op.latencyNs, 0.50) / 1000.0,
+         percentile(op.latencyNs, 0.95) / 1000.0, percentile(op.latencyNs, 0.99) / 1000.0,
+         n ? (double)op.allocs / n : 0.0, last ? "" : ",");
+}
+
+int main(int argc, char **argv)
+{
+  unsigned clients = 4;
+  unsigned rate = 0;
+  unsigned opsPerClient = 20000;
+  unsigned roundtrips = 50;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--clients") == 0)
+      clients = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--rate") == 0)
+      rate = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--ops") == 0)
+      opsPerClient = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--roundtrips") == 0)
+      roundtrips = atoi(argv[i + 1]);
+    else
+    {
+      fprintf(stderr, "usage: %s [--clients N] [--rate MSGS_PER_S_PER_CLIENT] [--ops N_PER_CLIENT] [--roundtrips N]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (clients == 0 || opsPerClient == 0)
+    return 2;
+
+  MqttTopics topics;
+  buildTopics(topics, "cg3000-BENCH");
+  const char *powerSet = topics.topics[TOPIC_POWER_SET];
+
+  SteadyClock clock;
+  SimClock unused; // ScriptedGpio needs a clock; outputs only latch
+  ScriptedGpio gpio(unused);
+  gpio.setLevel(PIN_RELAY_POWER, false); // so the first write does not allocate
+  BenchBroker broker(topics);
+  MqttPublisher pub = {};
+  CommandQueue queue;
+  std::mutex pushLock; // stands in for the firmware's portMUX around push
+
+  std::atomic<unsigned> producersDone{0};
+
+  std::vector<OpStats> dispatch(clients, OpStats("mqtt_dispatch"));
+  for (OpStats &op : dispatch)
+    op.reserve(opsPerClient);
+
+  OpStats relay{"command_to_relay"};
+  OpStats refresh{"status_refresh"};
+  OpStats publish{"publish_changes"};
+  OpStats roundtrip{"power_roundtrip"};
+  relay.reserve((size_t)clients * opsPerClient);
+  refresh.reserve(1 << 20);
+  publish.reserve(1 << 20);
+  roundtrip.reserve(roundtrips);
+
+  uint64_t startNs = nowNs();
+
+  std::vector<std::thread> producers;
+  for (unsigned c = 0; c < clients; ++c)
+  {
+    producers.emplace_back([&, c]()
+                           {
+      OpStats &op = dispatch[c];
+      uint64_t intervalNs = rate ? 1000000000ULL / rate : 0;
+      uint64_t next = nowNs();
+      for (unsigned i = 0; i < opsPerClient; ++i)
+      {
+        if (intervalNs)
+        {
+          while (nowNs() < next)
+            std::this_thread::yield();
+          next += intervalNs;
+        }
+        const char *payload = (i & 1) ? "OFF" : "ON";
+        while (commandQueueDepth(queue) >= CMD_QUEUE_SIZE)
+          std::this_thread::yield();
+
+        uint64_t t0 = nowNs();
+        t_allocSink = &op.allocs;
+        Command cmd;
+        if (mqttCommand(&topics, 1, powerSet, payload, strlen(payload), cmd))
+        {
+          cmd.rxUs = (uint32_t)(t0 / 1000); // carried by the command as in the firmware; wraps like micros()
+          std::lock_guard<std::mutex> guard(pushLock);
+          commandQueuePush(queue, cmd);
+        }
+        t_allocSink = nullptr;
+        op.latencyNs.push_back((uint32_t)(nowNs() - t0));
+      }
+      producersDone.fetch_add(1); });
+  }
+
+  // One pass of loop(); measure is false in the round-trip phase, so the
+  // per-stage stats only cover the load phase.
+  StatusSnapshot st = {};
+  const time_t lastReset[MAX_CHANNELS] = {};
+  auto controlStep = [&](bool measure)
+  {
+    Command cmd;
+    while (commandQueuePop(queue, cmd))
+    {
+      t_allocSink = measure ? &relay.allocs : nullptr;
+      applyPowerCommand(gpio, PIN_RELAY_POWER, cmd.type);
+      t_allocSink = nullptr;
+      uint64_t waitedNs = (uint64_t)((uint32_t)(nowNs() / 1000) - cmd.rxUs) * 1000;
+      if (measure)
+        relay.latencyNs.push_back((uint32_t)waitedNs);
+    }
+
+    t_allocSink = measure ? &refresh.allocs : nullptr;
+    uint64_t t0 = nowNs();
+    StatusSnapshot next = st;
+    next.channels = 1;
+    next.power[0] = gpio.read(PIN_RELAY_POWER);
+    next.mqttConnected = true;
+    statusUpdateTime(next, clock.now(), clock.millis(), lastReset);
+    if (!sameStatus(next, st))
+    {
+      next.generation = st.generation + 1;
+      st = next;
+    }
+    uint64_t t1 = nowNs();
+    t_allocSink = measure ? &publish.allocs : nullptr;
+    bool published = mqttPublishChanges(pub, broker, &topics, st, false, clock.millis());
+    t_allocSink = nullptr;
+    uint64_t t2 = nowNs();
+    if (measure)
+    {
+      refresh.latencyNs.push_back((uint32_t)(t1 - t0));
+      if (published)
+        publish.latencyNs.push_back((uint32_t)(t2 - t1));
+    }
+  };
+
+  for (;;)
+  {
+    bool done = producersDone.load() == clients && commandQueueDepth(queue) == 0;
+    controlStep(true);
+    if (done && !pub.changePending)
+      break;
+    std::this_thread::yield();
+  }
+
+  for (std::thread &t : producers)
+    t.join();
+  uint64_t wallNs = nowNs() - startNs;
+
+  // Producer-side stats from all clients as one operation.
+  OpStats all{"mqtt_dispatch"};
+  all.reserve((size_t)clients * opsPerClient);
+  for (OpStats &op : dispatch)
+  {
+    all.latencyNs.insert(all.latencyNs.end(), op.latencyNs.begin(), op.latencyNs.end());
+    all.allocs += op.allocs;
+  }
+  for (OpStats *op : {&all, &relay, &refresh, &publish})
+    op->wallNs = wallNs;
+  uint64_t loadPublishes = broker.publishes;
+
+  // Round trip: one client toggles power and waits for power/state each time.
+  uint64_t roundtripStartNs = nowNs();
+  for (unsigned i = 0; i < roundtrips; ++i)
+  {
+    const char *payload = st.power[0] ? "OFF" : "ON";
+    uint64_t powerBefore = broker.lastPowerPublishNs;
+    uint64_t t0 = nowNs();
+    Command cmd;
+    if (!mqttCommand(&topics, 1, powerSet, payload, strlen(payload), cmd))
+      return 1;
+    cmd.rxUs = (uint32_t)(t0 / 1000);
+    commandQueuePush(queue, cmd);
+    while (broker.lastPowerPublishNs == powerBefore)
+    {
+      controlStep(false);
+      std::this_thread::yield();
+    }
+    roundtrip.latencyNs.push_back((uint32_t)(broker.lastPowerPublishNs - t0));
+  }
+  roundtrip.wallNs = nowNs() - roundtripStartNs;
+
+  printf("{\n  \"bench\": \"mqtt_control_path\",\n  \"clients\": %u,\n  \"rate_per_client\": %u,\n"
+         "  \"ops_per_client\": %u,\n  \"wall_ms\": %.1f,\n  \"dropped\": %lu,\n  \"max_queue_depth\": %lu,\n"
+         "  \"mqtt_publishes\": %lu,\n  \"ops\": {\n",
+         clients, rate, opsPerClient, wallNs / 1e6, (unsigned long)queue.dropped.load(),
+         (unsigned long)queue.maxDepth.load(), (unsigned long)loadPublishes);
+  printOp(all, false);
+  printOp(relay, false);
+  printOp(refresh, false);
+  printOp(publish, false);
+  printOp(roundtrip, true);
+  printf("  }\n}\n");
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include "hal_native.h"
+
+#include <string.h>
+
+bool ScriptedGpio::read(uint8_t pin)
+{
+  uint32_t nowMs = _clock.millis();
+  while (_next < _steps.size() && _steps[_next].atMs <= nowMs)
+  {
+    _levels[_steps[_next].pin] = _steps[_next].high;
+    _next++;
+  }
+  return _levels[pin];
+}
+
+void MemoryBroker::publish(const char *topic, const char *payload, bool retain)
+{
+  _publishCount++;
+  if (retain)
+    _retained[topic] = payload;
+}
+
+bool MemoryFlash::read(uint32_t offset, void *buf, size_t len)
+{
+  if (offset + len > _data.size())
+    return false;
+  memcpy(buf, &_data[offset], len);
+  return true;
+}
+
+bool MemoryFlash::write(uint32_t offset, const void *buf, size_t len)
+{
+  if (offset + len > _data.size())
+    return false;
+  const uint8_t *p = (const uint8_t *)buf;
+  for (size_t i = 0; i < len; ++i)
+    _data[offset + i] &= p[i];
+  _writes++;
+  return true;
+}
+
+bool MemoryFlash::eraseSector(uint32_t offset)
+{
+  if (offset % FLASH_SECTOR_SIZE != 0 || offset + FLASH_SECTOR_SIZE > _data.size())
+    return false;
+  memset(&_data[offset], 0xFF, FLASH_SECTOR_SIZE);
+  _erases++;
+  return true;
+}
@@ -0,0 +1,89 @@
+#pragma once
+// Linux implementation of the hardware abstraction in lib/cg3000_core:
+// a clock that only moves when told to, GPIO inputs driven by a scripted
+// waveform, an in-memory broker that keeps retained messages and RAM-backed
+// flash.
+#include <map>
+#include <string>
+#include <vector>
+
+#include "hal.h"
+
+class SimClock : public HalClock
+{
+public:
+  uint32_t millis() override { return _ms; }
+  time_t now() override { return _epoch > 0 ? _epoch + _ms / 1000 : _ms / 1000; }
+
+  void set(uint32_t ms) { _ms = ms; }
+  void advance(uint32_t ms) { _ms += ms; }
+  void syncWallClock(time_t epochAtZero) { _epoch = epochAtZero; } // "NTP arrived"
+
+private:
+  uint32_t _ms = 0;
+  time_t _epoch = 0;
+};
+
+// Inputs follow a list of (time, pin, level) steps, outputs are plain latches.
+class ScriptedGpio : public HalGpio
+{
+public:
+  struct Step
+  {
+    uint32_t atMs;
+    uint8_t pin;
+    bool high;
+  };
+
+  explicit ScriptedGpio(SimClock &clock) : _clock(clock) {}
+
+  void script(uint8_t pin, uint32_t atMs, bool high) { _steps.push_back({atMs, pin, high}); }
+  void setLevel(uint8_t pin, bool high) { _levels[pin] = high; }
+  uint32_t lastStepMs() const { return _steps.empty() ? 0 : _steps.back().atMs; }
+
+  bool read(uint8_t pin) override;
+  void write(uint8_t pin, bool high) override { _levels[pin] = high; }
+
+private:
+  SimClock &_clock;
+  std::vector<Step> _steps; // in time order
+  size_t _next = 0;
+  std::map<uint8_t, bool> _levels;
+};
+
+class MemoryBroker : public HalMqtt
+{
+public:
+  bool connected() override { return _connected; }
+  void publish(const char *topic, const char *payload, bool retain) override;
+
+  void setConnected(bool connected) { _connected = connected; }
+  const std::map<std::string, std::string> &retained() const { return _retained; }
+  uint32_t publishCount() const { return _publishCount; }
+
+private:
+  bool _connected = true;
+  std::map<std::string, std::string> _retained;
+  uint32_t _publishCount = 0;
+};
+
+// NOR flash in RAM: erased bytes are 0xFF and writes only clear bits.
+const uint32_t FLASH_SECTOR_SIZE = 4096;
+
+class MemoryFlash : public HalFlash
+{
+public:
+  explicit MemoryFlash(size_t size) : _data(size, 0xFF) {}
+
+  bool read(uint32_t offset, void *buf, size_t len) override;
+  bool write(uint32_t offset, const void *buf, size_t len) override;
+  bool eraseSector(uint32_t offset) override;
+
+  uint32_t writes() const { return _writes; }
+  uint32_t erases() const { return _erases; }
+
+private:
+  std::vector<uint8_t> _data;
+  uint32_t _writes = 0;
+  uint32_t _erases = 0;
+};
@@ -0,0 +1,188 @@
+// Host replay of a recorded tuning-line trace through the same debounce,
+// status and MQTT publish logic the firmware runs, on a simulated clock.
+//
+// Trace format, one event per line, times in ms since boot:
+//   <ms> <0|1>         raw level of the tuning input (0 = LOW = tuning)
+//   <ms> ntp <epoch>   wall clock becomes valid, <epoch> at <ms>
+//   <ms> cmd <topic> <payload>
+//                      MQTT command for channel 1, <topic> without the
+//                      device prefix (e.g. "reset/set 10"); power commands
+//                      switch the simulated relay
+//   # comment
+//
+// Usage: program <trace>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "channels.h" // firmware channel table
+#include "control.h"
+#include "hal_native.h"
+#include "history.h"
+#include "journal.h"
+#include "mqtt_state.h"
+#include "status.h"
+#include "tuning.h"
+
+// Channel 1 of the firmware, so the replay follows include/channels.h.
+const uint8_t PIN_STATUS_TUNING = CHANNELS[0].tuning;
+const uint8_t PIN_RELAY_POWER = CHANNELS[0].power;
+
+const uint32_t REPLAY_TAIL_MS = 1000; // keep running after the last event to settle and publish
+
+struct NtpSync
+{
+  uint32_t atMs;
+  time_t epoch;
+};
+
+struct TraceCommand
+{
+  uint32_t atMs;
+  char topic[32];
+  char payload[32];
+};
+
+bool loadTrace(const char *path, ScriptedGpio &gpio, NtpSync &ntp, std::vector<TraceCommand> &commands)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    perror(path);
+    return false;
+  }
+  char line[128];
+  unsigned lineNo = 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    lineNo++;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    unsigned long ms;
+    long long epoch;
+    int level;
+    TraceCommand cmd = {};
+    int fields = sscanf(line, "%lu cmd %31s %31s", &ms, cmd.topic, cmd.payload);
+    if (fields >= 2)
+    {
+      cmd.atMs = (uint32_t)ms;
+      commands.push_back(cmd);
+    }
+    else if (sscanf(line, "%lu ntp %lld", &ms, &epoch) == 2)
+      ntp = {(uint32_t)ms, (time_t)epoch};
+    else if (sscanf(line, "%lu %d", &ms, &level) == 2)
+      gpio.script(PIN_STATUS_TUNING, (uint32_t)ms, level != 0);
+    else
+      fprintf(stderr, "%s:%u: ignoring '%s'\n", path, lineNo, strtok(line, "\n"));
+  }
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+    return 2;
+  }
+
+  SimClock clock;
+  ScriptedGpio gpio(clock);
+  MemoryBroker broker;
+  NtpSync ntp = {0, 0};
+  std::vector<TraceCommand> commands;
+
+  gpio.setLevel(PIN_STATUS_TUNING, true); // idle, pulled up
+  if (!loadTrace(argv[1], gpio, ntp, commands))
+    return 1;
+
+  MqttTopics topics;
+  buildTopics(topics, "cg3000-NATIVE");
+  size_t nextCommand = 0;
+  MqttPublisher pub = {};
+
+  TuningState tuning = {false, 0, 0};
+  TuningEdge edge = {false, 0};
+  static History history = {};
+  MemoryFlash flash(JOURNAL_SECTORS * JOURNAL_SECTOR_SIZE);
+  Journal journal;
+  JournalState persisted;
+  journalOpen(journal, flash, persisted);
+  bool raw = gpio.read(PIN_STATUS_TUNING);
+  StatusSnapshot st = {};
+  const time_t lastReset[MAX_CHANNELS] = {};
+
+  uint32_t endMs = gpio.lastStepMs() + REPLAY_TAIL_MS;
+  auto started = std::chrono::steady_clock::now();
+  for (uint32_t ms = 0; ms <= endMs; ++ms)
+  {
+    clock.set(ms);
+    if (ntp.epoch > 0 && ms == ntp.atMs)
+      clock.syncWallClock(ntp.epoch - ms / 1000);
+
+    for (; nextCommand < commands.size() && commands[nextCommand].atMs <= ms; ++nextCommand)
+    {
+      const TraceCommand &tc = commands[nextCommand];
+      char topic[TOPIC_MAX_LEN + 32];
+      snprintf(topic, sizeof(topic), "%s/%s", topics.base, tc.topic);
+      Command cmd = {};
+      if (!mqttCommand(&topics, 1, topic, tc.payload, strlen(tc.payload), cmd))
+      {
+        printf("%lu ms: %s '%s' -> invalid\n", (unsigned long)ms, tc.topic, tc.payload);
+        continue;
+      }
+      printf("%lu ms: %s '%s' -> %s %u\n", (unsigned long)ms, tc.topic, tc.payload, COMMAND_NAME[cmd.type], cmd.arg);
+      if (cmd.type <= CMD_POWER_TOGGLE)
+        applyPowerCommand(gpio, PIN_RELAY_POWER, cmd.type);
+    }
+
+    bool level = gpio.read(PIN_STATUS_TUNING);
+    if (level != raw)
+    {
+      raw = level;
+      tuningEdge(edge, ms);
+    }
+    if (tuningPoll(tuning, edge, !raw, ms))
+      historyTuning(history, 0, tuning.active, tuning.lastChangeMs, 0);
+
+    StatusSnapshot next = st;
+    next.channels = 1;
+    next.power[0] = gpio.read(PIN_RELAY_POWER);
+    next.tuning[0] = tuning.active;
+    next.mqttConnected = broker.connected();
+    statusUpdateTime(next, clock.now(), ms, lastReset);
+    if (history.tuneCount[0] != next.tune[0].count)
+      tuneStats(history, 0, next.tune[0]);
+    if (!sameStatus(next, st))
+    {
+      next.generation = st.generation + 1;
+      st = next;
+    }
+
+    mqttPublishChanges(pub, broker, &topics, st, false, ms);
+
+    persisted.power = st.power[0] ? 1 : 0;
+    persisted.tuneCycles = st.tune[0].count;
+    journalUpdate(journal, persisted, ms);
+  }
+  double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+
+  printf("simulated %lu ms, %.3f us per loop iteration\n", (unsigned long)endMs + 1, elapsedUs / (endMs + 1));
+  printf("tuning: %lu debounced transitions, active=%d\n", (unsigned long)tuning.transitions, tuning.active);
+  printf("tune cycles: %lu, min/avg/max %lu/%lu/%lu ms, p50 %lu ms, p90 %lu ms\n", (unsigned long)st.tune[0].count,
+         (unsigned long)st.tune[0].minMs, (unsigned long)st.tune[0].avgMs, (unsigned long)st.tune[0].maxMs,
+         (unsigned long)st.tune[0].p50Ms, (unsigned long)st.tune[0].p90Ms);
+  printf("journal: %lu records, %lu sector erases\n", (unsigned long)flash.writes(), (unsigned long)flash.erases());
+  printf("mqtt: %lu publishes\n", (unsigned long)broker.publishCount());
+  for (uint8_t i = 0; i < TOPIC_COUNT; ++i)
+  {
+    if (pub.publishCount[i] > 0)
+      printf("  %-16s %lu\n", TOPIC_SUFFIX[i] + 1, (unsigned long)pub.publishCount[i]);
+  }
+  for (const auto &kv : broker.retained())
+    printf("retained %s = %s\n", kv.first.c_str(), kv.second.c_str());
+  return 0;
+}
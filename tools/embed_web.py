@@ -0,0 +1,63 @@
+# PlatformIO pre-build script: minifies web/index.html, gzips it and writes
+# include/index_html_gz.h with the page as a PROGMEM byte array plus an ETag.
+#
+# Can also be run by hand: python tools/embed_web.py
+import gzip
+import hashlib
+import os
+import re
+
+try:
+    Import("env")  # noqa: F821 (provided by PlatformIO/SCons)
+    PROJECT_DIR = env.subst("$PROJECT_DIR")  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+SRC = os.path.join(PROJECT_DIR, "web", "index.html")
+DST = os.path.join(PROJECT_DIR, "include", "index_html_gz.h")
+
+
+def minify(html):
+    # Conservative: drop comments and indentation, keep line breaks so that
+    # the inline script never depends on automatic semicolon insertion.
+    html = re.sub(r"<!--.*?-->", "", html, flags=re.S)
+    html = re.sub(r"/\*.*?\*/", "", html, flags=re.S)
+    lines = (line.strip() for line in html.splitlines())
+    return "\n".join(line for line in lines if line)
+
+
+def render(data, etag):
+    rows = []
+    for i in range(0, len(data), 16):
+        rows.append("  " + ",".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+    return (
+        "#pragma once\n"
+        "// Generated by tools/embed_web.py from web/index.html - do not edit.\n"
+        "#include <Arduino.h>\n\n"
+        "const char INDEX_HTML_ETAG[] = \"\\\"%s\\\"\";\n"
+        "const size_t INDEX_HTML_GZ_LEN = %d;\n"
+        "const uint8_t INDEX_HTML_GZ[] PROGMEM = {\n%s\n};\n"
+        % (etag, len(data), "\n".join(rows))
+    )
+
+
+def main():
+    with open(SRC, "r", encoding="utf-8") as f:
+        page = minify(f.read()).encode("utf-8")
+
+    # mtime=0 keeps the output (and therefore the ETag) reproducible
+    data = gzip.compress(page, compresslevel=9, mtime=0)
+    etag = hashlib.sha256(data).hexdigest()[:16]
+    out = render(data, etag)
+
+    if os.path.exists(DST):
+        with open(DST, "r", encoding="utf-8") as f:
+            if f.read() == out:
+                return
+    os.makedirs(os.path.dirname(DST), exist_ok=True)
+    with open(DST, "w", encoding="utf-8") as f:
+        f.write(out)
+    print("embed_web: %d -> %d bytes (gzip), ETag %s" % (len(page), len(data), etag))
+
+
+main()
@@ -0,0 +1,187 @@
+# Load test for a running remote: drives /status, /power, /reset and the MQTT
+# power/set -> relay -> power/state round trip with concurrent clients at a
+# fixed rate and prints one JSON object (throughput, p50/p95/p99 latency,
+# errors per operation) so runs can be compared between firmware versions.
+#
+#   python tools/loadtest.py --host 192.168.1.50 --clients 4 --rate 5 --duration 30
+#   python tools/loadtest.py --host ... --mqtt-host mqtt.ham.local --device-id cg3000-ABCD1234
+#
+# /power and the MQTT round trip toggle the power relay; only run them against
+# a tuner that may be switched. Heap allocation counts come from the host
+# benchmark (pio run -e bench), the device does not expose them.
+import argparse
+import http.client
+import json
+import sys
+import threading
+import time
+
+HTTP_OPS = {
+    "status": ("GET", "/status"),
+    "power": ("POST", "/power"),
+    "reset": ("POST", "/reset"),
+}
+
+
+class OpStats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.errors = 0
+        self.codes = {}
+
+    def add(self, seconds, code):
+        with self.lock:
+            self.latencies.append(seconds)
+            self.codes[code] = self.codes.get(code, 0) + 1
+
+    def fail(self):
+        with self.lock:
+            self.errors += 1
+
+    def summary(self, wall):
+        lat = sorted(self.latencies)
+
+        def pct(p):
+            if not lat:
+                return None
+            return round(lat[min(len(lat) - 1, int(p * (len(lat) - 1) + 0.5))] * 1000.0, 3)
+
+        return {
+            "ops": len(lat),
+            "errors": self.errors,
+            "throughput_per_s": round(len(lat) / wall, 2) if wall > 0 else 0,
+            "p50_ms": pct(0.50),
+            "p95_ms": pct(0.95),
+            "p99_ms": pct(0.99),
+            "codes": {str(k): v for k, v in sorted(self.codes.items())},
+        }
+
+
+def paced(rate, deadline):
+    """Yields once per 1/rate seconds until deadline (rate 0 = no pause)."""
+    interval = 1.0 / rate if rate > 0 else 0
+    next_at = time.monotonic()
+    while time.monotonic() < deadline:
+        if interval:
+            delay = next_at - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            next_at += interval
+        yield
+
+
+def http_client(host, port, op, rate, deadline, stats, timeout):
+    method, path = HTTP_OPS[op]
+    conn = None
+    for _ in paced(rate, deadline):
+        try:
+            if conn is None:
+                conn = http.client.HTTPConnection(host, port, timeout=timeout)
+            start = time.perf_counter()
+            conn.request(method, path, headers={"Connection": "keep-alive"})
+            resp = conn.getresponse()
+            resp.read()
+            stats.add(time.perf_counter() - start, resp.status)
+            if resp.getheader("Connection", "").lower() == "close":
+                conn.close()
+                conn = None
+        except (OSError, http.client.HTTPException):
+            stats.fail()
+            if conn is not None:
+                conn.close()
+            conn = None
+    if conn is not None:
+        conn.close()
+
+
+def mqtt_roundtrip(args, deadline, stats):
+    try:
+        import paho.mqtt.client as mqtt
+    except ImportError:
+        print("loadtest: paho-mqtt not installed, skipping MQTT round trip", file=sys.stderr)
+        return
+
+    base = "cg3000/%s" % args.device_id
+    changed = threading.Condition()
+    state = {"power": None}
+
+    def on_message(client, userdata, msg):
+        with changed:
+            state["power"] = msg.payload.decode()
+            changed.notify_all()
+
+    client = mqtt.Client()
+    client.on_message = on_message
+    client.connect(args.mqtt_host, args.mqtt_port)
+    client.subscribe(base + "/power/state")
+    client.loop_start()
+    try:
+        with changed:
+            changed.wait_for(lambda: state["power"] is not None, timeout=args.timeout)
+        for _ in paced(args.rate, deadline):
+            with changed:
+                want = "OFF" if state["power"] == "ON" else "ON"
+                start = time.perf_counter()
+                client.publish(base + "/power/set", want)
+                if changed.wait_for(lambda: state["power"] == want, timeout=args.timeout):
+                    stats.add(time.perf_counter() - start, 200)
+                else:
+                    stats.fail()
+    finally:
+        client.loop_stop()
+        client.disconnect()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test for the CG-3000 remote")
+    parser.add_argument("--host", required=True, help="IP or name of the remote")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--ops", default="status", help="comma separated: status,power,reset")
+    parser.add_argument("--clients", type=int, default=4, help="concurrent clients per HTTP operation")
+    parser.add_argument("--rate", type=float, default=2.0, help="requests per second per client, 0 = unthrottled")
+    parser.add_argument("--duration", type=float, default=10.0, help="seconds")
+    parser.add_argument("--timeout", type=float, default=5.0, help="per-request timeout in seconds")
+    parser.add_argument("--mqtt-host", help="broker for the power/set round trip (needs paho-mqtt)")
+    parser.add_argument("--mqtt-port", type=int, default=1883)
+    parser.add_argument("--device-id", help="e.g. cg3000-ABCD1234, required with --mqtt-host")
+    args = parser.parse_args()
+
+    ops = [op for op in args.ops.split(",") if op]
+    for op in ops:
+        if op not in HTTP_OPS:
+            parser.error("unknown op %s" % op)
+    if args.mqtt_host and not args.device_id:
+        parser.error("--device-id is required with --mqtt-host")
+
+    stats = {op: OpStats() for op in ops}
+    if args.mqtt_host:
+        stats["mqtt_roundtrip"] = OpStats()
+
+    start = time.monotonic()
+    deadline = start + args.duration
+    threads = []
+    for op in ops:
+        for _ in range(args.clients):
+            threads.append(threading.Thread(
+                target=http_client, args=(args.host, args.port, op, args.rate, deadline, stats[op], args.timeout)))
+    if args.mqtt_host:
+        threads.append(threading.Thread(target=mqtt_roundtrip, args=(args, deadline, stats["mqtt_roundtrip"])))
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    wall = time.monotonic() - start
+
+    print(json.dumps({
+        "bench": "device_load",
+        "host": args.host,
+        "clients": args.clients,
+        "rate_per_client": args.rate,
+        "wall_s": round(wall, 3),
+        "ops": {op: s.summary(wall) for op, s in stats.items()},
+    }, indent=2))
+
+
+if __name__ == "__main__":
+    main()